@@ -1,2 +1,7 @@
+#include <stdio.h>
 
 int takeOverAMFID(int amfid_pid);
+
+// Print the handler's request counts, path interner memory, most requested paths and most
+// recent requests.
+void amfid_report(FILE *out);
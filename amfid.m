@@ -3,11 +3,17 @@
 #include <mach-o/loader.h>
 
 
+#include <fcntl.h>
 #include <pthread/pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 
 #include "mach_stuff.h"
 #include "cdhash.h"
+#include "cmssig.h"
+#include "pathintern.h"
 
 pthread_t exceptionThread;
 
@@ -30,6 +36,68 @@ vm_address_t ret0_gadget;
 mach_port_t amfid_task_port = MACH_PORT_NULL;
 mach_port_name_t exceptionPort = MACH_PORT_NULL;
 
+// The size of the path buffer amfid passes in x22.
+#define AMFID_PATH_SIZE 1024
+
+#define AMFID_MAX_PATH_COMPONENTS 0x10000
+#define AMFID_PATH_ARENA_SIZE 0x100000
+
+// Paths seen by the exception handler. The path ID is the key for everything kept per path:
+// the cdhash cache, the request counts and the trace. The path itself is still read out of
+// amfid for each request, since that is the only place it comes from, but it is never stored.
+path_interner *amfid_paths = NULL;
+
+// Signer chains already validated for a file with a CMS signature. A file that carries a CMS
+// signature is only approved if the signature verifies; ad-hoc signed files are approved
+// on their cdhash alone.
+#define AMFID_CHAIN_CACHE_SIZE 64
+#define AMFID_CHAIN_TTL 3600
+cms_chain_cache *amfid_chains = NULL;
+
+// What we know about a path: the last cdhash computed for it with the identity of the file it
+// was computed from, and how often it was asked for.
+typedef struct amfid_path_record {
+    bool have_cdhash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint8_t cdhash[CS_CDHASH_LEN];
+    uint32_t requests;
+    uint32_t hits;
+} amfid_path_record;
+
+// Records are allocated in chunks of path IDs as the IDs get used, so the table for a mostly
+// empty interner stays small.
+#define AMFID_RECORD_CHUNK 256
+amfid_path_record *amfid_records[AMFID_MAX_PATH_COMPONENTS / AMFID_RECORD_CHUNK + 1];
+
+typedef enum amfid_result {
+    AMFID_RESULT_HIT,
+    AMFID_RESULT_MISS,
+    AMFID_RESULT_FAILED,
+    AMFID_RESULT_REJECTED,
+} amfid_result;
+
+// The last AMFID_TRACE_SIZE requests, oldest first from amfid_trace_next.
+#define AMFID_TRACE_SIZE 1024
+typedef struct amfid_trace_entry {
+    uint64_t time_ns;
+    path_id path;
+    amfid_result result;
+} amfid_trace_entry;
+amfid_trace_entry amfid_trace[AMFID_TRACE_SIZE];
+uint64_t amfid_trace_next = 0;
+
+uint64_t amfid_requests = 0;
+uint64_t amfid_hits = 0;
+uint64_t amfid_failures = 0;
+uint64_t amfid_rejections = 0;
+uint64_t amfid_lookup_ns = 0;
+
+pthread_mutex_t amfid_records_lock = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct {
     mach_msg_header_t Head;
     mach_msg_body_t msgh_body;
@@ -78,6 +146,13 @@ uint32_t amfid_read32(vm_address_t where) {
 
 
 
+// Read from amfid into a buffer of ours.
+bool amfid_read_into(uint64_t addr, void *buf, size_t len) {
+    mach_vm_size_t outsize = 0;
+    kret = mach_vm_read_overwrite(amfid_task_port, addr, len, (mach_vm_address_t)buf, &outsize);
+    return kret == KERN_SUCCESS && outsize == len;
+}
+
 void* amfid_read(uint64_t addr, uint64_t len) {
     kern_return_t ret;
     vm_offset_t buf = 0;
@@ -111,6 +186,218 @@ uint64_t find_text_base() {
     return first_addr;
 }
 
+uint64_t amfid_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The record for a path ID, allocating its chunk if need be. Must be called with
+// amfid_records_lock held.
+amfid_path_record *amfid_path_record_get(path_id id) {
+    if (id == PATH_ID_NONE || id > AMFID_MAX_PATH_COMPONENTS) {
+        return NULL;
+    }
+    amfid_path_record **chunk = &amfid_records[id / AMFID_RECORD_CHUNK];
+    if (*chunk == NULL) {
+        *chunk = calloc(AMFID_RECORD_CHUNK, sizeof(**chunk));
+        if (*chunk == NULL) {
+            return NULL;
+        }
+    }
+    return &(*chunk)[id % AMFID_RECORD_CHUNK];
+}
+
+bool amfid_path_record_matches(const amfid_path_record *record, const struct stat *st) {
+    return record->have_cdhash
+        && record->dev == st->st_dev && record->ino == st->st_ino && record->size == st->st_size
+        && record->mtime.tv_sec == st->st_mtimespec.tv_sec
+        && record->mtime.tv_nsec == st->st_mtimespec.tv_nsec
+        && record->ctime.tv_sec == st->st_ctimespec.tv_sec
+        && record->ctime.tv_nsec == st->st_ctimespec.tv_nsec;
+}
+
+void amfid_path_record_set(amfid_path_record *record, const struct stat *st, const uint8_t *cdhash) {
+    record->have_cdhash = true;
+    record->dev = st->st_dev;
+    record->ino = st->st_ino;
+    record->size = st->st_size;
+    record->mtime = st->st_mtimespec;
+    record->ctime = st->st_ctimespec;
+    memcpy(record->cdhash, cdhash, CS_CDHASH_LEN);
+}
+
+// Compute the cdhash of a file and get the identity fstat() gave for the descriptor that was
+// hashed, failing if the file changed while it was being hashed.
+bool amfid_compute_cdhash(const char *path, struct stat *st, uint8_t *cdhash) {
+    file_source *src = file_source_open_path(path);
+    if (src == NULL) {
+        return false;
+    }
+    struct stat after;
+    bool ok = file_source_stat(src, st)
+        && compute_cdhash_source(src, cdhash)
+        && file_source_stat(src, &after);
+    file_source_close(src);
+    return ok
+        && st->st_dev == after.st_dev && st->st_ino == after.st_ino
+        && st->st_size == after.st_size
+        && st->st_mtimespec.tv_sec == after.st_mtimespec.tv_sec
+        && st->st_mtimespec.tv_nsec == after.st_mtimespec.tv_nsec
+        && st->st_ctimespec.tv_sec == after.st_ctimespec.tv_sec
+        && st->st_ctimespec.tv_nsec == after.st_ctimespec.tv_nsec;
+}
+
+// Check the CMS signature of a file, if it has one, making sure the file is still the one
+// with identity st that was hashed.
+bool amfid_check_signer(const char *path, const struct stat *st) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat now;
+    bool ok = false;
+    if (fstat(fd, &now) == 0 && now.st_size > 0
+        && st->st_dev == now.st_dev && st->st_ino == now.st_ino && st->st_size == now.st_size
+        && st->st_mtimespec.tv_sec == now.st_mtimespec.tv_sec
+        && st->st_mtimespec.tv_nsec == now.st_mtimespec.tv_nsec
+        && st->st_ctimespec.tv_sec == now.st_ctimespec.tv_sec
+        && st->st_ctimespec.tv_nsec == now.st_ctimespec.tv_nsec) {
+        void *file = mmap(NULL, now.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file != MAP_FAILED) {
+            cs_signature_blobs blobs;
+            ok = cs_find_signature_blobs(file, now.st_size, &blobs)
+                && (blobs.cms == NULL || cms_verify_signature(&blobs, amfid_chains));
+            munmap(file, now.st_size);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Get the cdhash of a path, from its record if the file hasn't changed since, and account for
+// the request in the stats and the trace.
+bool amfid_lookup_cdhash(const char *path, uint8_t *cdhash) {
+    uint64_t start = amfid_now_ns();
+    path_id id = path_intern(amfid_paths, path);
+    struct stat st;
+    bool have_stat = (stat(path, &st) == 0);
+    amfid_result result = AMFID_RESULT_FAILED;
+    pthread_mutex_lock(&amfid_records_lock);
+    amfid_path_record *record = amfid_path_record_get(id);
+    if (record != NULL) {
+        record->requests++;
+    }
+    if (record != NULL && have_stat && amfid_path_record_matches(record, &st)) {
+        memcpy(cdhash, record->cdhash, CS_CDHASH_LEN);
+        record->hits++;
+        result = AMFID_RESULT_HIT;
+    }
+    pthread_mutex_unlock(&amfid_records_lock);
+    // Hash outside the lock, so that amfid_report() never waits for a file to be read. The
+    // record can't go away meanwhile: chunks are never freed.
+    // A record is only set once the signer checked out, so a hit needs no signer check.
+    if (result != AMFID_RESULT_HIT && amfid_compute_cdhash(path, &st, cdhash)) {
+        result = amfid_check_signer(path, &st) ? AMFID_RESULT_MISS : AMFID_RESULT_REJECTED;
+    }
+    pthread_mutex_lock(&amfid_records_lock);
+    if (result == AMFID_RESULT_MISS && record != NULL) {
+        amfid_path_record_set(record, &st, cdhash);
+    }
+    amfid_requests++;
+    amfid_hits += (result == AMFID_RESULT_HIT);
+    amfid_failures += (result == AMFID_RESULT_FAILED);
+    amfid_rejections += (result == AMFID_RESULT_REJECTED);
+    amfid_trace_entry *entry = &amfid_trace[amfid_trace_next++ % AMFID_TRACE_SIZE];
+    entry->time_ns = start;
+    entry->path = id;
+    entry->result = result;
+    amfid_lookup_ns += amfid_now_ns() - start;
+    pthread_mutex_unlock(&amfid_records_lock);
+    return result == AMFID_RESULT_HIT || result == AMFID_RESULT_MISS;
+}
+
+// Print the request counts, what interning the paths saved, the most requested paths and the
+// most recent requests.
+void amfid_report(FILE *out) {
+    static const char *result_names[] = { "hit", "miss", "failed", "rejected" };
+    if (amfid_paths == NULL) {
+        return;
+    }
+    path_interner_stats stats;
+    path_interner_get_stats(amfid_paths, &stats);
+    pthread_mutex_lock(&amfid_records_lock);
+    fprintf(out, "%llu requests, %llu hits, %llu failed, %llu rejected, %.1f us per request\n",
+            amfid_requests, amfid_hits, amfid_failures, amfid_rejections,
+            amfid_requests ? amfid_lookup_ns / 1e3 / amfid_requests : 0.0);
+    fprintf(out, "%u paths in %u components: %zu bytes as strings, %zu used, %zu allocated\n",
+            stats.paths, stats.components, stats.raw_bytes, stats.used_bytes,
+            stats.allocated_bytes);
+    // The ten most requested paths.
+    path_id top[10] = { 0 };
+    uint32_t top_requests[10] = { 0 };
+    for (path_id id = 1; id <= stats.components; id++) {
+        amfid_path_record *chunk = amfid_records[id / AMFID_RECORD_CHUNK];
+        uint32_t requests = (chunk != NULL ? chunk[id % AMFID_RECORD_CHUNK].requests : 0);
+        for (int i = 0; i < 10; i++) {
+            if (requests > top_requests[i]) {
+                memmove(&top[i + 1], &top[i], (9 - i) * sizeof(top[0]));
+                memmove(&top_requests[i + 1], &top_requests[i],
+                        (9 - i) * sizeof(top_requests[0]));
+                top[i] = id;
+                top_requests[i] = requests;
+                break;
+            }
+        }
+    }
+    char path[AMFID_PATH_SIZE];
+    for (int i = 0; i < 10 && top[i] != PATH_ID_NONE; i++) {
+        const amfid_path_record *record =
+            &amfid_records[top[i] / AMFID_RECORD_CHUNK][top[i] % AMFID_RECORD_CHUNK];
+        if (path_intern_copy(amfid_paths, top[i], path, sizeof(path)) == 0) {
+            strcpy(path, "?");
+        }
+        fprintf(out, "  %8u requests %8u hits  %s\n", record->requests, record->hits, path);
+    }
+    // The last few requests.
+    uint64_t first = (amfid_trace_next > 16 ? amfid_trace_next - 16 : 0);
+    for (uint64_t i = first; i < amfid_trace_next; i++) {
+        const amfid_trace_entry *entry = &amfid_trace[i % AMFID_TRACE_SIZE];
+        if (path_intern_copy(amfid_paths, entry->path, path, sizeof(path)) == 0) {
+            strcpy(path, "?");
+        }
+        fprintf(out, "  %12.3f ms %-8s %s\n", entry->time_ns / 1e6,
+                result_names[entry->result], path);
+    }
+    pthread_mutex_unlock(&amfid_records_lock);
+}
+
+// Reply to an exception and release the thread and task ports it carried. Any result other
+// than KERN_SUCCESS passes the exception on, so amfid crashes instead of approving the binary.
+void amfid_exception_reply(exception_raise_request *request, kern_return_t result) {
+    exception_raise_reply reply = {0};
+    
+    reply.Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->Head.msgh_bits), 0);
+    reply.Head.msgh_size = sizeof(reply);
+    reply.Head.msgh_remote_port = request->Head.msgh_remote_port;
+    reply.Head.msgh_local_port = MACH_PORT_NULL;
+    reply.Head.msgh_id = request->Head.msgh_id + 0x64;
+    
+    reply.NDR = request->NDR;
+    reply.RetCode = result;
+    
+    kret = mach_msg(&reply.Head,
+                   1,
+                   (mach_msg_size_t)sizeof(reply),
+                   0,
+                   MACH_PORT_NULL,
+                   MACH_MSG_TIMEOUT_NONE,
+                   MACH_PORT_NULL);
+    
+    mach_port_deallocate(mach_task_self(), request->thread.name);
+    mach_port_deallocate(mach_task_self(), request->task.name);
+}
+
 void *amfid_exception_handler(void* arg) {
     
     
@@ -125,7 +412,6 @@ void *amfid_exception_handler(void* arg) {
     else {
         exception_raise_request* request = (exception_raise_request*)msg;
         mach_port_t thread_port = request->thread.name;
-        mach_port_t task_port = request->task.name;
         
         _STRUCT_ARM_THREAD_STATE64 old_state = {0};
         mach_msg_type_number_t old_stateCnt = sizeof(old_state)/4;
@@ -133,16 +419,23 @@ void *amfid_exception_handler(void* arg) {
         kret = thread_get_state(thread_port, ARM_THREAD_STATE64, (thread_state_t)&old_state, &old_stateCnt);
                     if (kret != KERN_SUCCESS){
                         printf("Failed to get thread state from amfid\n");
+                        amfid_exception_reply(request, KERN_FAILURE);
                         continue;
                     }
         
         _STRUCT_ARM_THREAD_STATE64 new_state;
         memcpy(&new_state, &old_state, sizeof(_STRUCT_ARM_THREAD_STATE64));
         
-        char *file = (char*)amfid_read(new_state.__x[22], 1024);
-        
-        if (!file) {
+        // The path is read into a fixed buffer, and used only if it is terminated within it.
+        char file[AMFID_PATH_SIZE];
+        if (!amfid_read_into(new_state.__x[22], file, sizeof(file))) {
             printf("No file inputted to amfid?!\n");
+            amfid_exception_reply(request, KERN_FAILURE);
+            continue;
+        }
+        if (strnlen(file, sizeof(file)) == sizeof(file)) {
+            printf("Path from amfid is not terminated\n");
+            amfid_exception_reply(request, KERN_FAILURE);
             continue;
         }
         
@@ -150,16 +443,12 @@ void *amfid_exception_handler(void* arg) {
         
         // compute cdhash
         
-        FILE* fp = fopen(file, "rb");
-        fseek(fp, 0, SEEK_END);
-        size_t len = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        void *file_to_compute = (void*)malloc(len);
-        fread(file_to_compute, 1, len, fp);
-        fclose(fp);
-        
         uint8_t cdhash[CS_CDHASH_LEN];
-        compute_cdhash(file_to_compute, len, cdhash);
+        if (!amfid_lookup_cdhash(file, cdhash)) {
+            printf("Failed to compute CDHASH or verify the signer for %s\n", file);
+            amfid_exception_reply(request, KERN_FAILURE);
+            continue;
+        }
         printf("[*] Got CDHASH for %s\n", file);
         for (int i = 0; i < CS_CDHASH_LEN; i++) {
                 printf("%02x ", cdhash[i]);
@@ -167,14 +456,13 @@ void *amfid_exception_handler(void* arg) {
         
         printf("\n");
         
-        free(file_to_compute);
-        
         // write cdhash to amfid
         
         kret = mach_vm_write(amfid_task_port, old_state.__x[23], (vm_offset_t)&cdhash, 20);
         if (kret != KERN_SUCCESS) {
             printf("Failed to write cdhash to amfid\n");
-            return KERN_SUCCESS;
+            amfid_exception_reply(request, KERN_FAILURE);
+            continue;
         }
         
         
@@ -187,32 +475,13 @@ void *amfid_exception_handler(void* arg) {
         kret = thread_set_state(thread_port, 6, (thread_state_t)&new_state, sizeof(new_state)/4);
         if (kret != KERN_SUCCESS) {
             printf("Failed to set new thread state\n");
-            return KERN_SUCCESS;
+            amfid_exception_reply(request, KERN_FAILURE);
+            continue;
         }
         
         printf("[*] Set new thread state\n");
         
-        exception_raise_reply reply = {0};
-                    
-                    reply.Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->Head.msgh_bits), 0);
-                    reply.Head.msgh_size = sizeof(reply);
-                    reply.Head.msgh_remote_port = request->Head.msgh_remote_port;
-                    reply.Head.msgh_local_port = MACH_PORT_NULL;
-                    reply.Head.msgh_id = request->Head.msgh_id + 0x64;
-                    
-                    reply.NDR = request->NDR;
-                    reply.RetCode = KERN_SUCCESS;
-                    
-                    kret = mach_msg(&reply.Head,
-                                   1,
-                                   (mach_msg_size_t)sizeof(reply),
-                                   0,
-                                   MACH_PORT_NULL,
-                                   MACH_MSG_TIMEOUT_NONE,
-                                   MACH_PORT_NULL);
-        
-        mach_port_deallocate(mach_task_self(), thread_port);
-        mach_port_deallocate(mach_task_self(), task_port);
+        amfid_exception_reply(request, KERN_SUCCESS);
        
         
         
@@ -268,6 +537,22 @@ int takeOverAMFID(int amfid_pid) {
         return KERN_SUCCESS;
     }
     
+    if (amfid_paths == NULL) {
+        amfid_paths = path_interner_create(AMFID_MAX_PATH_COMPONENTS, AMFID_PATH_ARENA_SIZE);
+        if (amfid_paths == NULL) {
+            util_error("Failed to create amfid path interner");
+            return KERN_SUCCESS;
+        }
+    }
+    
+    if (amfid_chains == NULL) {
+        amfid_chains = cms_chain_cache_create(AMFID_CHAIN_CACHE_SIZE, AMFID_CHAIN_TTL);
+        if (amfid_chains == NULL) {
+            util_error("Failed to create amfid chain cache");
+            return KERN_SUCCESS;
+        }
+    }
+    
     pthread_create(&exceptionThread, NULL, amfid_exception_handler, NULL);
     
     util_info("Set amfid exception port");
@@ -17,9 +17,13 @@
 
 
 
-#include <CommonCrypto/CommonCrypto.h>
-#include <mach-o/loader.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
 #include "cdhash.h"
+#include "csdigest.h"
+#include "macho_defs.h"
+#include "perfctr.h"
 
 // Check whether the file looks like a Mach-O file.
 static bool
@@ -31,13 +35,9 @@ macho_identify(const struct mach_header_64 *mh, size_t size) {
     return true;
 }
 
-// Perform some basic validation on the Mach-O header. This is NOT enough to be sure that the
-// Mach-O is safe!
+// Check that the load commands of a Mach-O fit in the given size.
 static bool
-macho_validate(const struct mach_header_64 *mh, size_t size) {
-    if (!macho_identify(mh, size)) {
-        return false;
-    }
+macho_validate_load_commands(const struct mach_header_64 *mh, size_t size) {
     // Check that the load commands fit in the file.
     if (mh->sizeofcmds > size) {
         return false;
@@ -59,6 +59,19 @@ macho_validate(const struct mach_header_64 *mh, size_t size) {
     return true;
 }
 
+// Perform some basic validation on the Mach-O header. This is NOT enough to be sure that the
+// Mach-O is safe!
+static bool
+macho_validate(const struct mach_header_64 *mh, size_t size) {
+    if (!macho_identify(mh, size)) {
+        return false;
+    }
+    PERFCTR_BEGIN(perf);
+    bool ok = macho_validate_load_commands(mh, size);
+    PERFCTR_END(PERFCTR_STAGE_MACHO_VALIDATE, perf, mh->sizeofcmds);
+    return ok;
+}
+
 // Get the next load command in a Mach-O file.
 static const void *
 macho_next_load_command(const struct mach_header_64 *mh, size_t size, const void *lc) {
@@ -144,35 +157,49 @@ cs_superblob_validate(CS_SuperBlob *sb, size_t size) {
 // Compute the cdhash of a code directory using SHA1.
 static void
 cdhash_sha1(CS_CodeDirectory *cd, size_t length, void *cdhash) {
-    uint8_t digest[CC_SHA1_DIGEST_LENGTH];
-    CC_SHA1(cd, (CC_LONG) length, digest);
+    uint8_t digest[CS_DIGEST_SHA1_LEN];
+    cs_digest_sha1(cd, length, digest);
     memcpy(cdhash, digest, CS_CDHASH_LEN);
 }
 
 // Compute the cdhash of a code directory using SHA256.
 static void
 cdhash_sha256(CS_CodeDirectory *cd, size_t length, void *cdhash) {
-    uint8_t digest[CC_SHA256_DIGEST_LENGTH];
-    CC_SHA256(cd, (CC_LONG) length, digest);
+    uint8_t digest[CS_DIGEST_SHA256_LEN];
+    cs_digest_sha256(cd, length, digest);
+    memcpy(cdhash, digest, CS_CDHASH_LEN);
+}
+
+// Compute the cdhash of a code directory using SHA384.
+static void
+cdhash_sha384(CS_CodeDirectory *cd, size_t length, void *cdhash) {
+    uint8_t digest[CS_DIGEST_SHA384_LEN];
+    cs_digest_sha384(cd, length, digest);
     memcpy(cdhash, digest, CS_CDHASH_LEN);
 }
 
-// Compute the cdhash from a CS_CodeDirectory.
+// Compute the cdhash from a CS_CodeDirectory. The cdhash is the code directory's digest with
+// its own hash type, truncated to CS_CDHASH_LEN.
 static bool
 cs_codedirectory_cdhash(CS_CodeDirectory *cd, size_t size, void *cdhash) {
     size_t length = ntohl(cd->length);
+    PERFCTR_BEGIN(perf);
     switch (cd->hashType) {
         case CS_HASHTYPE_SHA1:
-            
             cdhash_sha1(cd, length, cdhash);
-            return true;
+            break;
         case CS_HASHTYPE_SHA256:
-           
+        case CS_HASHTYPE_SHA256_TRUNCATED:
             cdhash_sha256(cd, length, cdhash);
-            return true;
+            break;
+        case CS_HASHTYPE_SHA384:
+            cdhash_sha384(cd, length, cdhash);
+            break;
+        default:
+            return false;
     }
-    
-    return false;
+    PERFCTR_END(PERFCTR_STAGE_CDHASH, perf, length);
+    return true;
 }
 
 // Get the rank of a code directory.
@@ -195,9 +222,10 @@ cs_codedirectory_rank(CS_CodeDirectory *cd) {
     return 0;
 }
 
-// Compute the cdhash from a CS_SuperBlob.
+// Find the best code directory in a CS_SuperBlob.
 static bool
-cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, void *cdhash) {
+cs_superblob_best_codedirectory(CS_SuperBlob *sb, size_t size,
+        CS_CodeDirectory **best_cd_out, size_t *best_cd_size_out) {
     // Iterate through each index searching for the best code directory.
     CS_CodeDirectory *best_cd = NULL;
     unsigned best_cd_rank = 0;
@@ -235,13 +263,15 @@ cs_superblob_cdhash(CS_SuperBlob *sb, size_t size, void *cdhash) {
         
         return false;
     }
-    // Hash the code directory.
-    return cs_codedirectory_cdhash(best_cd, best_cd_size, cdhash);
+    *best_cd_out = best_cd;
+    *best_cd_size_out = best_cd_size;
+    return true;
 }
 
-// Compute the cdhash from a csblob.
+// Find the best code directory in a csblob.
 static bool
-csblob_cdhash(CS_GenericBlob *blob, size_t size, void *cdhash) {
+csblob_find_codedirectory(CS_GenericBlob *blob, size_t size,
+        CS_CodeDirectory **cd, size_t *cd_size) {
     // Make sure we at least have a CS_GenericBlob.
     if (size < sizeof(*blob)) {
        
@@ -256,28 +286,46 @@ csblob_cdhash(CS_GenericBlob *blob, size_t size, void *cdhash) {
         return false;
     }
     // Handle the blob.
-    bool ok;
+    size_t ok;
     switch (magic) {
-        case CSMAGIC_EMBEDDED_SIGNATURE:
+        case CSMAGIC_EMBEDDED_SIGNATURE: {
             ok = cs_superblob_validate((CS_SuperBlob *)blob, length);
             if (!ok) {
                 return false;
             }
-            return cs_superblob_cdhash((CS_SuperBlob *)blob, length, cdhash);
+            PERFCTR_BEGIN(perf);
+            ok = cs_superblob_best_codedirectory((CS_SuperBlob *)blob, length, cd, cd_size);
+            PERFCTR_END(PERFCTR_STAGE_SUPERBLOB_SELECT, perf, length);
+            return ok;
+        }
         case CSMAGIC_CODEDIRECTORY:
             ok = cs_codedirectory_validate((CS_CodeDirectory *)blob, length);
             if (!ok) {
                 return false;
             }
-            return cs_codedirectory_cdhash((CS_CodeDirectory *)blob, length, cdhash);
+            *cd = (CS_CodeDirectory *)blob;
+            *cd_size = ok;
+            return true;
     }
     
     return false;
 }
 
-// Compute the cdhash for a Mach-O file.
+// Compute the cdhash from a csblob.
 static bool
-compute_cdhash_macho(const struct mach_header_64 *mh, size_t size, void *cdhash) {
+csblob_cdhash(CS_GenericBlob *blob, size_t size, void *cdhash) {
+    CS_CodeDirectory *cd;
+    size_t cd_size;
+    if (!csblob_find_codedirectory(blob, size, &cd, &cd_size)) {
+        return false;
+    }
+    return cs_codedirectory_cdhash(cd, cd_size, cdhash);
+}
+
+// Find the code signature data of a Mach-O file.
+static bool
+macho_find_code_signature(const struct mach_header_64 *mh, size_t size,
+        const uint8_t **cs_data_out, size_t *cs_size_out) {
     // Find the code signature command.
     const struct linkedit_data_command *cs_cmd =
         macho_find_load_command(mh, size, LC_CODE_SIGNATURE, NULL);
@@ -292,8 +340,21 @@ compute_cdhash_macho(const struct mach_header_64 *mh, size_t size, void *cdhash)
         
         return false;
     }
+    *cs_data_out = cs_data;
+    *cs_size_out = cs_end - cs_data;
+    return true;
+}
+
+// Compute the cdhash for a Mach-O file.
+static bool
+compute_cdhash_macho(const struct mach_header_64 *mh, size_t size, void *cdhash) {
+    const uint8_t *cs_data;
+    size_t cs_size;
+    if (!macho_find_code_signature(mh, size, &cs_data, &cs_size)) {
+        return false;
+    }
     // Check that the code signature data looks correct.
-    return csblob_cdhash((CS_GenericBlob *)cs_data, cs_end - cs_data, cdhash);
+    return csblob_cdhash((CS_GenericBlob *)cs_data, cs_size, cdhash);
 }
 
 bool
@@ -301,13 +362,380 @@ compute_cdhash(const void *file, size_t size, void *cdhash) {
     // Try to compute the cdhash for a Mach-O file.
     const struct mach_header_64 *mh = file;
     if (macho_identify(mh, size)) {
-        if (!macho_validate(mh, size)) {
-            
-            return false;
-        }
-        return compute_cdhash_macho(mh, size, cdhash);
+        // The file stage covers validation through hashing, the same span as
+        // compute_cdhash_source() with its reads.
+        PERFCTR_BEGIN(perf);
+        bool ok = macho_validate(mh, size) && compute_cdhash_macho(mh, size, cdhash);
+        PERFCTR_END(PERFCTR_STAGE_FILE, perf, size);
+        return ok;
     }
     // What is it?
     
     return false;
 }
+
+// Compute the cdhash of a Mach-O file read from a file source.
+static bool
+compute_cdhash_source_macho(file_source *src, void *cdhash) {
+    // Read the header and check that it looks like a Mach-O file.
+    struct mach_header_64 header;
+    if (src->size < sizeof(header) || !file_source_read(src, &header, sizeof(header), 0)) {
+        return false;
+    }
+    if (!macho_identify(&header, src->size) || header.sizeofcmds > src->size - sizeof(header)) {
+        return false;
+    }
+    // Read the load commands. Only the header and the signature are needed for the cdhash, so
+    // the rest of the file is never read.
+    size_t header_size = sizeof(header) + header.sizeofcmds;
+    struct mach_header_64 *mh = malloc(header_size);
+    if (mh == NULL) {
+        return false;
+    }
+    bool ok = false;
+    uint8_t *cs_data = NULL;
+    if (!file_source_read(src, mh, header_size, 0)
+            || !macho_validate_load_commands(mh, header_size)) {
+        goto out;
+    }
+    const struct linkedit_data_command *cs_cmd =
+        macho_find_load_command(mh, header_size, LC_CODE_SIGNATURE, NULL);
+    if (cs_cmd == NULL || cs_cmd->datasize == 0 || cs_cmd->dataoff == 0
+            || cs_cmd->dataoff > src->size || cs_cmd->datasize > src->size - cs_cmd->dataoff) {
+        goto out;
+    }
+    // Ask for the whole signature at once; a real file can then be read in one large I/O
+    // rather than readahead-sized pieces.
+    file_source_prefetch(src, cs_cmd->dataoff, cs_cmd->datasize);
+    cs_data = malloc(cs_cmd->datasize);
+    if (cs_data == NULL || !file_source_read(src, cs_data, cs_cmd->datasize, cs_cmd->dataoff)) {
+        goto out;
+    }
+    ok = csblob_cdhash((CS_GenericBlob *)cs_data, cs_cmd->datasize, cdhash);
+out:
+    free(cs_data);
+    free(mh);
+    return ok;
+}
+
+bool
+compute_cdhash_source(file_source *src, void *cdhash) {
+    PERFCTR_BEGIN(perf);
+    bool ok = compute_cdhash_source_macho(src, cdhash);
+    PERFCTR_END(PERFCTR_STAGE_FILE, perf, src->size);
+    return ok;
+}
+
+bool
+cs_find_signature_blobs(const void *file, size_t size, cs_signature_blobs *blobs) {
+    memset(blobs, 0, sizeof(*blobs));
+    const struct mach_header_64 *mh = file;
+    if (!macho_validate(mh, size)) {
+        return false;
+    }
+    const uint8_t *cs_data;
+    size_t cs_size;
+    if (!macho_find_code_signature(mh, size, &cs_data, &cs_size)) {
+        return false;
+    }
+    CS_SuperBlob *sb = (CS_SuperBlob *)cs_data;
+    size_t sb_size = cs_superblob_validate(sb, cs_size);
+    if (sb_size == 0) {
+        return false;
+    }
+    bool have_primary = false;
+    uint32_t count = ntohl(sb->count);
+    for (size_t i = 0; i < count; i++) {
+        CS_BlobIndex *index = &sb->index[i];
+        uint32_t type = ntohl(index->type);
+        uint32_t offset = ntohl(index->offset);
+        if (offset > sb_size) {
+            return false;
+        }
+        if (type == CSSLOT_CODEDIRECTORY ||
+                (CSSLOT_ALTERNATE_CODEDIRECTORIES <= type && type < CSSLOT_ALTERNATE_CODEDIRECTORY_LIMIT)) {
+            CS_CodeDirectory *cd = (CS_CodeDirectory *)((uint8_t *)sb + offset);
+            size_t cd_size = cs_codedirectory_validate(cd, sb_size - offset);
+            if (cd_size == 0) {
+                return false;
+            }
+            // Keep the primary code directory in slot 0, in the order the signer hashed them.
+            unsigned slot;
+            if (type == CSSLOT_CODEDIRECTORY) {
+                if (have_primary) {
+                    return false;
+                }
+                have_primary = true;
+                slot = 0;
+            } else {
+                slot = 1 + (type - CSSLOT_ALTERNATE_CODEDIRECTORIES);
+            }
+            if (blobs->code_directories[slot] != NULL) {
+                return false;
+            }
+            blobs->code_directories[slot] = cd;
+            blobs->code_directory_sizes[slot] = cd_size;
+            blobs->code_directory_hash_valid[slot] =
+                cs_codedirectory_cdhash(cd, cd_size, blobs->code_directory_cdhashes[slot]);
+        } else if (type == CSSLOT_SIGNATURESLOT) {
+            CS_GenericBlob *blob = (CS_GenericBlob *)((uint8_t *)sb + offset);
+            if (sb_size - offset < sizeof(*blob)
+                    || ntohl(blob->magic) != CSMAGIC_BLOBWRAPPER
+                    || ntohl(blob->length) < sizeof(*blob)
+                    || ntohl(blob->length) > sb_size - offset) {
+                return false;
+            }
+            blobs->cms = blob;
+            blobs->cms_size = ntohl(blob->length);
+        }
+    }
+    return have_primary;
+}
+
+// Byte-swap a big-endian 64-bit code signing field.
+static uint64_t
+cs_ntohll(uint64_t x) {
+    return ((uint64_t)ntohl((uint32_t)x) << 32) | ntohl((uint32_t)(x >> 32));
+}
+
+// Get the limit of the signed range of the file from a CS_CodeDirectory.
+static uint64_t
+cs_codedirectory_code_limit(const CS_CodeDirectory *cd, size_t cd_size) {
+    uint32_t version = ntohl(cd->version);
+    if (version >= CS_SUPPORTSCODELIMIT64
+            && cd_size >= offsetof(CS_CodeDirectory, end_withCodeLimit64)
+            && cd->codeLimit64 != 0) {
+        return cs_ntohll(cd->codeLimit64);
+    }
+    return ntohl(cd->codeLimit);
+}
+
+// Get the digest length for a code directory hash type, or 0 if unsupported.
+static size_t
+cs_hash_length(uint8_t hash_type) {
+    switch (hash_type) {
+        case CS_HASHTYPE_SHA1:
+            return CS_SHA1_LEN;
+        case CS_HASHTYPE_SHA256:
+            return CS_SHA256_LEN;
+        case CS_HASHTYPE_SHA256_TRUNCATED:
+            return CS_SHA256_TRUNCATED_LEN;
+        case CS_HASHTYPE_SHA384:
+            return CS_DIGEST_SHA384_LEN;
+    }
+    return 0;
+}
+
+// Hash a page of the file with the given hash type. The digest buffer must be
+// CS_HASH_MAX_SIZE bytes.
+static void
+cs_hash_page(uint8_t hash_type, const void *data, size_t length, uint8_t *digest) {
+    PERFCTR_BEGIN(perf);
+    switch (hash_type) {
+        case CS_HASHTYPE_SHA1:
+            cs_digest_sha1(data, length, digest);
+            break;
+        case CS_HASHTYPE_SHA256:
+        case CS_HASHTYPE_SHA256_TRUNCATED:
+            cs_digest_sha256(data, length, digest);
+            break;
+        case CS_HASHTYPE_SHA384:
+            cs_digest_sha384(data, length, digest);
+            break;
+    }
+    PERFCTR_END(PERFCTR_STAGE_PAGE_HASH, perf, length);
+}
+
+bool
+cs_page_verifier_init(cs_page_verifier *pv, const void *file, size_t size) {
+    memset(pv, 0, sizeof(*pv));
+    // Find the best code directory, exactly as compute_cdhash() would.
+    const struct mach_header_64 *mh = file;
+    if (!macho_validate(mh, size)) {
+        return false;
+    }
+    const uint8_t *cs_data;
+    size_t cs_size;
+    if (!macho_find_code_signature(mh, size, &cs_data, &cs_size)) {
+        return false;
+    }
+    CS_CodeDirectory *cd;
+    size_t cd_size;
+    if (!csblob_find_codedirectory((CS_GenericBlob *)cs_data, cs_size, &cd, &cd_size)) {
+        return false;
+    }
+    // The hash slots must be of the size the hash type produces.
+    size_t hash_size = cs_hash_length(cd->hashType);
+    if (hash_size == 0 || hash_size != cd->hashSize) {
+        return false;
+    }
+    // The signed range must lie within the file.
+    uint64_t code_limit = cs_codedirectory_code_limit(cd, cd_size);
+    if (code_limit == 0 || code_limit > size) {
+        return false;
+    }
+    // A page size of 0 means the whole signed range is a single page.
+    uint64_t page_size = code_limit;
+    if (cd->pageSize != 0) {
+        if (cd->pageSize >= 32) {
+            return false;
+        }
+        page_size = 1ull << cd->pageSize;
+    }
+    uint64_t page_count = (code_limit + page_size - 1) / page_size;
+    // Check that the code slots fit in the code directory.
+    uint32_t hash_offset = ntohl(cd->hashOffset);
+    uint32_t code_slots = ntohl(cd->nCodeSlots);
+    if (code_slots != page_count
+            || hash_offset > cd_size
+            || (uint64_t)code_slots * hash_size > cd_size - hash_offset) {
+        return false;
+    }
+    pv->verified = calloc((page_count + 7) / 8, 1);
+    if (pv->verified == NULL) {
+        return false;
+    }
+    pv->file = file;
+    pv->size = size;
+    pv->cd = cd;
+    pv->cd_size = cd_size;
+    pv->hashes = (const uint8_t *)cd + hash_offset;
+    pv->hash_type = cd->hashType;
+    pv->hash_size = hash_size;
+    pv->page_size = page_size;
+    pv->code_limit = code_limit;
+    pv->page_count = (uint32_t) page_count;
+    return true;
+}
+
+void
+cs_page_verifier_destroy(cs_page_verifier *pv) {
+    free(pv->verified);
+    pv->verified = NULL;
+}
+
+bool
+cs_page_verify(cs_page_verifier *pv, uint32_t page) {
+    if (page >= pv->page_count) {
+        return false;
+    }
+    // Skip the page if a previous access already verified it.
+    uint8_t bit = 1 << (page % 8);
+    if (__atomic_load_n(&pv->verified[page / 8], __ATOMIC_ACQUIRE) & bit) {
+        return true;
+    }
+    uint64_t offset = (uint64_t)page * pv->page_size;
+    uint64_t length = pv->code_limit - offset;
+    if (length > pv->page_size) {
+        length = pv->page_size;
+    }
+    uint8_t digest[CS_HASH_MAX_SIZE];
+    cs_hash_page(pv->hash_type, pv->file + offset, length, digest);
+    if (memcmp(digest, pv->hashes + (size_t)page * pv->hash_size, pv->hash_size) != 0) {
+        return false;
+    }
+    __atomic_fetch_add(&pv->pages_hashed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&pv->verified[page / 8], bit, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool
+cs_page_verify_range(cs_page_verifier *pv, uint64_t offset, uint64_t length) {
+    if (length == 0) {
+        return true;
+    }
+    if (offset >= pv->code_limit || length > pv->code_limit - offset) {
+        return false;
+    }
+    uint32_t first = (uint32_t)(offset / pv->page_size);
+    uint32_t last = (uint32_t)((offset + length - 1) / pv->page_size);
+    for (uint32_t page = first; page <= last; page++) {
+        if (!cs_page_verify(pv, page)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Verify the pages of a file range, clamped to the signed range.
+static bool
+cs_page_verify_clamped(cs_page_verifier *pv, uint64_t offset, uint64_t length) {
+    if (offset >= pv->code_limit || length == 0) {
+        return true;
+    }
+    if (length > pv->code_limit - offset) {
+        length = pv->code_limit - offset;
+    }
+    return cs_page_verify_range(pv, offset, length);
+}
+
+// Verify the pages that will execute first: the executable segment named by the code
+// directory, then any other segment mapped executable.
+static bool
+cs_page_verify_exec_segments(cs_page_verifier *pv) {
+    const CS_CodeDirectory *cd = pv->cd;
+    if (ntohl(cd->version) >= CS_SUPPORTSEXECSEG
+            && pv->cd_size >= offsetof(CS_CodeDirectory, end_withExecSeg)) {
+        uint64_t base = cs_ntohll(cd->execSegBase);
+        uint64_t limit = cs_ntohll(cd->execSegLimit);
+        if (!cs_page_verify_clamped(pv, base, limit)) {
+            return false;
+        }
+    }
+    const struct mach_header_64 *mh = (const struct mach_header_64 *)pv->file;
+    const struct segment_command_64 *seg = NULL;
+    for (;;) {
+        seg = macho_find_load_command(mh, pv->size, LC_SEGMENT_64, seg);
+        if (seg == NULL) {
+            return true;
+        }
+        if (seg->cmdsize < sizeof(*seg) || !(seg->initprot & VM_PROT_EXECUTE)) {
+            continue;
+        }
+        if (!cs_page_verify_clamped(pv, seg->fileoff, seg->filesize)) {
+            return false;
+        }
+    }
+}
+
+// Verify the rest of the pages in the background.
+static void *
+cs_page_verify_remaining(void *arg) {
+    cs_prioritized_verification *job = arg;
+    bool ok = true;
+    for (uint32_t page = 0; ok && page < job->pv->page_count; page++) {
+        ok = cs_page_verify(job->pv, page);
+    }
+    job->ok = ok;
+    return NULL;
+}
+
+bool
+cs_page_verify_prioritized(cs_page_verifier *pv, cs_exec_verified_callback callback,
+        void *context, cs_prioritized_verification *job) {
+    memset(job, 0, sizeof(*job));
+    job->pv = pv;
+    bool exec_ok = cs_page_verify_exec_segments(pv);
+    if (callback != NULL) {
+        callback(pv, exec_ok, context);
+    }
+    if (!exec_ok) {
+        return false;
+    }
+    // If we can't get a thread, finish the work here; the caller already has its answer.
+    if (pthread_create(&job->thread, NULL, cs_page_verify_remaining, job) != 0) {
+        cs_page_verify_remaining(job);
+        return true;
+    }
+    job->started = true;
+    return true;
+}
+
+bool
+cs_prioritized_verification_wait(cs_prioritized_verification *job) {
+    if (job->started) {
+        pthread_join(job->thread, NULL);
+        job->started = false;
+    }
+    return job->ok;
+}
@@ -3,10 +3,13 @@
 #ifndef cdhash_h
 #define cdhash_h
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "cs_blobs.h"
+#include "filesource.h"
 
 /*
  * compute_cdhash
@@ -22,4 +25,165 @@
  */
 bool compute_cdhash(const void *file, size_t size, void *cdhash);
 
+/*
+ * compute_cdhash_source
+ *
+ * Description:
+ *     Compute the cdhash of a Mach-O file read from a file source. Only the header, the load
+ *     commands and the code signature are read.
+ *
+ * Parameters:
+ *     src                 The file source to read the Mach-O file from.
+ *     cdhash            out    On return, contains the cdhash of the file. Must be
+ *                     CS_CDHASH_LEN bytes.
+ */
+bool compute_cdhash_source(file_source *src, void *cdhash);
+
+/*
+ * cs_signature_blobs
+ *
+ * Description:
+ *     The blobs of an embedded signature that a signer identity check needs. Slot 0 holds the
+ *     CSSLOT_CODEDIRECTORY code directory; slot 1 + n holds alternate code directory n. The
+ *     cdhash of each code directory is computed with its own hash type, if supported.
+ */
+typedef struct cs_signature_blobs {
+    const CS_CodeDirectory *code_directories[1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX];
+    size_t code_directory_sizes[1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX];
+    uint8_t code_directory_cdhashes[1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX][CS_CDHASH_LEN];
+    bool code_directory_hash_valid[1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX];
+    const CS_GenericBlob *cms;
+    size_t cms_size;
+} cs_signature_blobs;
+
+/*
+ * cs_find_signature_blobs
+ *
+ * Description:
+ *     Locate the code directories and the CMS signature blob (CSSLOT_SIGNATURESLOT) of a
+ *     Mach-O file. blobs->cms is NULL if the file is ad-hoc signed.
+ *
+ * Parameters:
+ *     file                The contents of the Mach-O file.
+ *     size                The size of the Mach-O file.
+ *     blobs             out    On return, points into file.
+ */
+bool cs_find_signature_blobs(const void *file, size_t size, cs_signature_blobs *blobs);
+
+/*
+ * cs_page_verifier
+ *
+ * Description:
+ *     State for lazily checking the pages of a Mach-O file against the code slots of the
+ *     CodeDirectory that compute_cdhash() selects. Pages are hashed on first access only;
+ *     verified pages are remembered in a bitmap, so later accesses cost a single bit test.
+ *     The file contents must stay mapped for the lifetime of the verifier.
+ */
+typedef struct cs_page_verifier {
+    const uint8_t *file;
+    size_t size;
+    const CS_CodeDirectory *cd;
+    size_t cd_size;
+    const uint8_t *hashes;
+    uint8_t hash_type;
+    size_t hash_size;
+    uint64_t page_size;
+    uint64_t code_limit;
+    uint32_t page_count;
+    uint32_t pages_hashed;
+    uint8_t *verified;
+} cs_page_verifier;
+
+/*
+ * cs_page_verifier_init
+ *
+ * Description:
+ *     Prepare a verifier for a Mach-O file. No pages are hashed.
+ *
+ * Parameters:
+ *     pv                out    The verifier to initialize.
+ *     file                The contents of the Mach-O file.
+ *     size                The size of the Mach-O file.
+ */
+bool cs_page_verifier_init(cs_page_verifier *pv, const void *file, size_t size);
+
+/*
+ * cs_page_verifier_destroy
+ *
+ * Description:
+ *     Release the resources held by a verifier.
+ */
+void cs_page_verifier_destroy(cs_page_verifier *pv);
+
+/*
+ * cs_page_verify
+ *
+ * Description:
+ *     Verify a single page of the file against its code slot, unless it has already been
+ *     verified. Safe to call concurrently for the same verifier.
+ */
+bool cs_page_verify(cs_page_verifier *pv, uint32_t page);
+
+/*
+ * cs_page_verify_range
+ *
+ * Description:
+ *     Verify every page overlapping the given byte range of the file. Intended to be called
+ *     when the range is first touched, e.g. from the fault handler behind cs_lazy_map().
+ */
+bool cs_page_verify_range(cs_page_verifier *pv, uint64_t offset, uint64_t length);
+
+/*
+ * cs_exec_verified_callback
+ *
+ * Description:
+ *     Called by cs_page_verify_prioritized() once the executable pages have been checked, with
+ *     ok set if all of them matched their code slots.
+ */
+typedef void (*cs_exec_verified_callback)(cs_page_verifier *pv, bool ok, void *context);
+
+/*
+ * cs_prioritized_verification
+ *
+ * Description:
+ *     The background half of a cs_page_verify_prioritized() call.
+ */
+typedef struct cs_prioritized_verification {
+    cs_page_verifier *pv;
+    pthread_t thread;
+    bool started;
+    bool ok;
+} cs_prioritized_verification;
+
+/*
+ * cs_page_verify_prioritized
+ *
+ * Description:
+ *     Verify the executable pages of the file first, as given by the code directory's
+ *     execSegBase/execSegLimit and the executable LC_SEGMENT_64 commands, and report the
+ *     result through the callback before returning. If they verified, the remaining pages
+ *     are then verified on a background thread; use cs_prioritized_verification_wait() to get
+ *     the final result.
+ *
+ * Parameters:
+ *     pv                  An initialized verifier.
+ *     callback            Called with the result for the executable pages. May be NULL.
+ *     context             Passed to the callback.
+ *     job               out    The background verification to wait on.
+ *
+ * Returns:
+ *     Whether the executable pages verified.
+ */
+bool cs_page_verify_prioritized(cs_page_verifier *pv, cs_exec_verified_callback callback,
+        void *context, cs_prioritized_verification *job);
+
+/*
+ * cs_prioritized_verification_wait
+ *
+ * Description:
+ *     Wait for the background half of a prioritized verification and return whether every
+ *     page of the file verified.
+ */
+bool cs_prioritized_verification_wait(cs_prioritized_verification *job);
+
 #endif /* cdhash_h */
@@ -0,0 +1,935 @@
+
+/*
+ * Local cdhash service
+ * --------------------
+ *
+ *  One thread accepts connections and one reader thread per connection turns requests into
+ *  jobs for the scheduler; a fixed pool of workers serves jobs in the order the scheduler
+ *  picks. Workers never write to a socket themselves: replies are queued on the connection
+ *  and written by its writer thread, so a client that is slow to read its replies only
+ *  stalls itself. The reader stops reading while its client has max_queued requests waiting
+ *  in the scheduler or max_queued replies waiting for the writer, which bounds the memory one
+ *  client can make the service hold. A connection stays alive while its reader, its writer or
+ *  any of its jobs refers to it.
+ *
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE         // struct ucred
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cdhash.h"
+#include "cdhashd.h"
+#include "cdhring.h"
+
+// The most file descriptors a request carries (CDHASHD_OP_ATTACH_RING).
+#define CDHASHD_MAX_FDS 4
+
+// A client that hangs up must cost us a failed send, not a SIGPIPE. Darwin has no
+// MSG_NOSIGNAL and sets SO_NOSIGPIPE on the socket instead.
+#if defined(MSG_NOSIGNAL)
+#define CDHASHD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define CDHASHD_SEND_FLAGS 0
+#endif
+
+#if defined(__APPLE__)
+#define CDHASHD_ST_MTIM st_mtimespec
+#define CDHASHD_ST_CTIM st_ctimespec
+#else
+#define CDHASHD_ST_MTIM st_mtim
+#define CDHASHD_ST_CTIM st_ctim
+#endif
+
+// The end of a cache hash chain or of the LRU list.
+#define CDHASHD_CACHE_NIL UINT32_MAX
+
+// What a cached cdhash is valid for. Any write to the file changes its ctime.
+typedef struct cdhashd_file_id {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} cdhashd_file_id;
+
+typedef struct cdhashd_cache_entry {
+    cdhashd_file_id file;
+    uint8_t cdhash[CS_CDHASH_LEN];
+    uint32_t hash_next;
+    uint32_t lru_prev;              // towards the most recently used entry
+    uint32_t lru_next;
+} cdhashd_cache_entry;
+
+typedef struct cdhashd_conn {
+    struct cdhashd_conn *next;
+    cdhashd *service;
+    int fd;
+    cdh_client *client;
+    cdh_class class;
+    pthread_mutex_t out_lock;
+    pthread_cond_t out_ready;
+    pthread_cond_t out_space;       // the writer took the queued replies
+    cdhring_service *ring;          // attached shared-memory ring, if any
+    cdhashd_reply *out;             // replies waiting for the writer
+    size_t out_count;
+    size_t out_capacity;
+    unsigned max_queued;
+    bool closing;
+    unsigned refs;                  // protected by the service lock
+} cdhashd_conn;
+
+typedef struct cdhashd_job {
+    cdhashd_conn *conn;
+    uint32_t tag;
+    char path[];
+} cdhashd_job;
+
+struct cdhashd {
+    cdhashd_config config;
+    int listen_fd;
+    int wake_pipe[2];
+    pthread_t accept_thread;
+    pthread_t *workers;
+    cdh_sched *sched;
+    pthread_mutex_t cache_lock;
+    cdhashd_cache_entry *cache;
+    uint32_t *cache_buckets;        // chains of entries by (dev, ino)
+    uint32_t cache_mask;
+    uint32_t cache_count;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+    pthread_cond_t conns_gone;
+    cdhashd_conn *conns;
+};
+
+static void
+cdhashd_default_classify(uid_t uid, pid_t pid, cdh_class *class, unsigned *weight,
+        unsigned *max_inflight, unsigned *max_queued) {
+    (void)pid;
+    if (uid == 0) {
+        *class = CDH_CLASS_INTERACTIVE;
+        *weight = 4;
+        *max_inflight = 4;
+        *max_queued = 256;
+    } else {
+        *class = CDH_CLASS_NORMAL;
+        *weight = 1;
+        *max_inflight = 2;
+        *max_queued = 64;
+    }
+}
+
+// Get the credentials of the process on the other end of a connection.
+static bool
+cdhashd_peer_credentials(int fd, uid_t *uid, pid_t *pid) {
+#if defined(__APPLE__)
+    gid_t gid;
+    socklen_t length = sizeof(*pid);
+    return getpeereid(fd, uid, &gid) == 0
+        && getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, pid, &length) == 0;
+#elif defined(__linux__)
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+        return false;
+    }
+    *uid = cred.uid;
+    *pid = cred.pid;
+    return true;
+#else
+    (void)fd; (void)uid; (void)pid;
+    return false;
+#endif
+}
+
+static bool
+cdhashd_read_all(int fd, void *buf, size_t length) {
+    uint8_t *p = buf;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Whether the other end of a connection has gone away.
+static bool
+cdhashd_hung_up(int fd) {
+    struct pollfd pfd = { .fd = fd };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+static void
+cdhashd_deadline(struct timespec *deadline, long ns) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += ns;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static bool
+cdhashd_send_all(int fd, const void *buf, size_t length) {
+    const uint8_t *p = buf;
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, CDHASHD_SEND_FLAGS);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// ---- Connections ------------------------------------------------------------------------------
+
+static void
+cdhashd_conn_unref(cdhashd_conn *conn) {
+    cdhashd *service = conn->service;
+    pthread_mutex_lock(&service->lock);
+    if (--conn->refs != 0) {
+        pthread_mutex_unlock(&service->lock);
+        return;
+    }
+    for (cdhashd_conn **p = &service->conns; *p != NULL; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    if (service->conns == NULL) {
+        pthread_cond_broadcast(&service->conns_gone);
+    }
+    pthread_mutex_unlock(&service->lock);
+    close(conn->fd);
+    cdhring_service_detach(conn->ring);
+    pthread_cond_destroy(&conn->out_ready);
+    pthread_cond_destroy(&conn->out_space);
+    pthread_mutex_destroy(&conn->out_lock);
+    free(conn->out);
+    free(conn);
+}
+
+// Queue a reply for the connection's writer. Replies to a closing connection are dropped.
+static void
+cdhashd_send_reply(cdhashd_conn *conn, const cdhashd_reply *reply) {
+    pthread_mutex_lock(&conn->out_lock);
+    if (!conn->closing && conn->out_count == conn->out_capacity) {
+        size_t capacity = conn->out_capacity ? 2 * conn->out_capacity : 16;
+        cdhashd_reply *out = realloc(conn->out, capacity * sizeof(*out));
+        if (out != NULL) {
+            conn->out = out;
+            conn->out_capacity = capacity;
+        } else {
+            // The client would wait for this reply forever, so hang up on it instead. That
+            // also stops the reader, which is blocked reading from the socket.
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            pthread_cond_signal(&conn->out_ready);
+            pthread_cond_signal(&conn->out_space);
+        }
+    }
+    if (!conn->closing && conn->out_count < conn->out_capacity) {
+        conn->out[conn->out_count++] = *reply;
+        pthread_cond_signal(&conn->out_ready);
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+}
+
+// Deliver replies through a ring, waiting for the client to make room as needed.
+static bool
+cdhashd_push_ring(cdhashd_conn *conn, cdhring_service *ring, const cdhashd_reply *replies,
+        size_t count) {
+    size_t sent = 0;
+    for (;;) {
+        size_t n = cdhring_service_push(ring, replies + sent, count - sent);
+        if (n == (size_t)-1) {
+            return false;
+        }
+        sent += n;
+        if (sent == count) {
+            return true;
+        }
+        if (cdhring_service_want_space(ring)) {
+            continue;
+        }
+        pthread_mutex_lock(&conn->out_lock);
+        bool closing = conn->closing;
+        pthread_mutex_unlock(&conn->out_lock);
+        if (closing) {
+            return false;
+        }
+        // The timeout only bounds how long we take to notice the connection closing.
+        cdhring_service_wait_space(ring, 10);
+    }
+}
+
+// Write queued replies until the connection closes.
+static void *
+cdhashd_writer(void *arg) {
+    cdhashd_conn *conn = arg;
+    cdhashd_reply *batch = NULL;
+    size_t batch_capacity = 0;
+    pthread_mutex_lock(&conn->out_lock);
+    for (;;) {
+        while (conn->out_count == 0 && !conn->closing) {
+            pthread_cond_wait(&conn->out_ready, &conn->out_lock);
+        }
+        if (conn->out_count == 0) {
+            break;
+        }
+        // Swap the queue out so workers can keep adding to it while we write.
+        cdhashd_reply *out = conn->out;
+        size_t count = conn->out_count;
+        size_t capacity = conn->out_capacity;
+        conn->out = batch;
+        conn->out_capacity = batch_capacity;
+        conn->out_count = 0;
+        batch = out;
+        batch_capacity = capacity;
+        pthread_cond_signal(&conn->out_space);
+        cdhring_service *ring = conn->ring;
+        pthread_mutex_unlock(&conn->out_lock);
+        bool ok = (ring != NULL
+                ? cdhashd_push_ring(conn, ring, batch, count)
+                : cdhashd_send_all(conn->fd, batch, count * sizeof(*batch)));
+        pthread_mutex_lock(&conn->out_lock);
+        if (!ok) {
+            conn->closing = true;
+            conn->out_count = 0;
+            pthread_cond_signal(&conn->out_space);
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    free(batch);
+    cdhashd_conn_unref(conn);
+    return NULL;
+}
+
+// Free a job that was dropped before it was served.
+static void
+cdhashd_free_job(void *arg) {
+    cdhashd_job *job = arg;
+    cdhashd_conn_unref(job->conn);
+    free(job);
+}
+
+// Stop taking requests from a client while it has more replies waiting for its writer than
+// its quota, i.e. while it isn't reading them. Returns false if the connection is going away.
+static bool
+cdhashd_wait_for_reply_space(cdhashd_conn *conn) {
+    pthread_mutex_lock(&conn->out_lock);
+    while (conn->out_count >= conn->max_queued && !conn->closing) {
+        struct timespec deadline;
+        cdhashd_deadline(&deadline, 10000000);
+        // A ring client that dies leaves the writer waiting for reply slots rather than
+        // failing a write, so look for the hangup here.
+        if (pthread_cond_timedwait(&conn->out_space, &conn->out_lock, &deadline) == ETIMEDOUT
+                && cdhashd_hung_up(conn->fd)) {
+            conn->closing = true;
+            pthread_cond_signal(&conn->out_ready);
+        }
+    }
+    bool ok = !conn->closing;
+    pthread_mutex_unlock(&conn->out_lock);
+    return ok;
+}
+
+// Queue a hash request from a connection, waiting while the client is over its quota.
+// Returns false if the connection is going away.
+static bool
+cdhashd_submit(cdhashd_conn *conn, uint32_t tag, const char *path) {
+    cdhashd *service = conn->service;
+    if (!cdhashd_wait_for_reply_space(conn)) {
+        return false;
+    }
+    size_t length = strlen(path);
+    cdhashd_job *job = malloc(sizeof(*job) + length + 1);
+    if (job == NULL) {
+        cdhashd_reply reply = { .tag = tag, .status = CDHASHD_STATUS_ERROR };
+        cdhashd_send_reply(conn, &reply);
+        return true;
+    }
+    job->conn = conn;
+    job->tag = tag;
+    memcpy(job->path, path, length + 1);
+    pthread_mutex_lock(&service->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&service->lock);
+    if (!cdh_sched_submit(service->sched, conn->client, job)) {
+        cdhashd_free_job(job);
+        return false;
+    }
+    return true;
+}
+
+// Read a request header, along with any file descriptors sent with it.
+static bool
+cdhashd_read_header(int fd, cdhashd_request_header *header, int *fds, int *fd_count) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(CDHASHD_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(*header) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return false;
+    }
+    *fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*fd_count < CDHASHD_MAX_FDS) {
+                fds[(*fd_count)++] = received;
+            } else {
+                close(received);
+            }
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC)
+            || !cdhashd_read_all(fd, (uint8_t *)header + n, sizeof(*header) - n)) {
+        for (int i = 0; i < *fd_count; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Attach a shared-memory ring to a connection.
+static bool
+cdhashd_attach_ring(cdhashd_conn *conn, const int *fds, int fd_count) {
+    if (fd_count != 4 || conn->ring != NULL) {
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    cdhring_service *ring = cdhring_service_attach(fds[0], fds[1], fds[2], fds[3]);
+    close(fds[0]);
+    if (ring == NULL) {
+        for (int i = 1; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    pthread_mutex_lock(&conn->out_lock);
+    conn->ring = ring;
+    pthread_mutex_unlock(&conn->out_lock);
+    return true;
+}
+
+typedef struct cdhashd_ring_context {
+    cdhashd_conn *conn;
+    bool ok;
+} cdhashd_ring_context;
+
+static void
+cdhashd_ring_request(void *arg, uint32_t tag, const char *path) {
+    cdhashd_ring_context *context = arg;
+    if (context->ok) {
+        context->ok = cdhashd_submit(context->conn, tag, path);
+    }
+}
+
+// Wait for the socket to become readable, serving the ring while we wait. Returns false if
+// the client corrupted the ring or the connection is going away.
+static bool
+cdhashd_serve_ring(cdhashd_conn *conn) {
+    cdhring_service *ring = conn->ring;
+    for (;;) {
+        if (!cdhring_service_want_requests(ring)) {
+            struct pollfd fds[2] = {
+                { .fd = conn->fd, .events = POLLIN },
+                { .fd = cdhring_service_request_fd(ring), .events = POLLIN },
+            };
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                return false;
+            }
+            if (fds[0].revents != 0) {
+                return true;
+            }
+        }
+        // cdhashd_submit() blocks while the client is over its quota, which stops the drain
+        // and leaves the client's further requests in the ring.
+        cdhashd_ring_context context = { .conn = conn, .ok = true };
+        if (!cdhring_service_drain(ring, cdhashd_ring_request, &context) || !context.ok) {
+            return false;
+        }
+    }
+}
+
+// Read requests from a connection until it closes.
+static void *
+cdhashd_reader(void *arg) {
+    cdhashd_conn *conn = arg;
+    cdhashd *service = conn->service;
+    char path[CDHASHD_MAX_PATH + 1];
+    for (;;) {
+        cdhashd_request_header header;
+        int fds[CDHASHD_MAX_FDS];
+        int fd_count;
+        if ((conn->ring != NULL && !cdhashd_serve_ring(conn))
+                || !cdhashd_read_header(conn->fd, &header, fds, &fd_count)) {
+            break;
+        }
+        if (header.op == CDHASHD_OP_ATTACH_RING) {
+            if (!cdhashd_attach_ring(conn, fds, fd_count)) {
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        if (header.length > CDHASHD_MAX_PATH
+                || !cdhashd_read_all(conn->fd, path, header.length)) {
+            break;
+        }
+        path[header.length] = '\0';
+        if (header.op == CDHASHD_OP_SET_CLASS) {
+            // Clients may lower their priority but never raise it.
+            if (header.tag < CDH_CLASS_COUNT && header.tag >= conn->class) {
+                conn->class = header.tag;
+                cdh_sched_client_set_class(service->sched, conn->client, conn->class);
+            }
+            continue;
+        }
+        if (header.op != CDHASHD_OP_HASH || !cdhashd_submit(conn, header.tag, path)) {
+            break;
+        }
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+    cdh_sched_client_release(service->sched, conn->client);
+    pthread_mutex_lock(&conn->out_lock);
+    conn->closing = true;
+    pthread_cond_signal(&conn->out_ready);
+    pthread_mutex_unlock(&conn->out_lock);
+    cdhashd_conn_unref(conn);
+    return NULL;
+}
+
+// Accept connections until the service stops.
+static void *
+cdhashd_acceptor(void *arg) {
+    cdhashd *service = arg;
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = service->listen_fd, .events = POLLIN },
+            { .fd = service->wake_pipe[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        int fd = accept(service->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        uid_t uid;
+        pid_t pid;
+        if (!cdhashd_peer_credentials(fd, &uid, &pid)) {
+            close(fd);
+            continue;
+        }
+#if defined(SO_NOSIGPIPE)
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        cdh_class class;
+        unsigned weight, max_inflight, max_queued;
+        service->config.classify(uid, pid, &class, &weight, &max_inflight, &max_queued);
+        cdhashd_conn *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->client = cdh_sched_client_create(service->sched, uid, pid, class, weight,
+                max_inflight, max_queued);
+        if (conn->client == NULL) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->service = service;
+        conn->fd = fd;
+        conn->class = class;
+        conn->max_queued = max_queued;
+        conn->refs = 2;
+        pthread_mutex_init(&conn->out_lock, NULL);
+        pthread_cond_init(&conn->out_ready, NULL);
+        pthread_cond_init(&conn->out_space, NULL);
+        pthread_mutex_lock(&service->lock);
+        conn->next = service->conns;
+        service->conns = conn;
+        pthread_mutex_unlock(&service->lock);
+        pthread_t writer, reader;
+        if (pthread_create(&writer, NULL, cdhashd_writer, conn) != 0) {
+            cdh_sched_client_release(service->sched, conn->client);
+            cdhashd_conn_unref(conn);
+            cdhashd_conn_unref(conn);
+            continue;
+        }
+        pthread_detach(writer);
+        if (pthread_create(&reader, NULL, cdhashd_reader, conn) != 0) {
+            // Run the reader's shutdown path here instead.
+            shutdown(fd, SHUT_RDWR);
+            cdhashd_reader(conn);
+            continue;
+        }
+        pthread_detach(reader);
+    }
+    return NULL;
+}
+
+// ---- Workers ----------------------------------------------------------------------------------
+
+static void
+cdhashd_file_id_init(cdhashd_file_id *file, const struct stat *st) {
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime = st->CDHASHD_ST_MTIM;
+    file->ctime = st->CDHASHD_ST_CTIM;
+}
+
+static bool
+cdhashd_file_id_equal(const cdhashd_file_id *a, const cdhashd_file_id *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec
+        && a->ctime.tv_sec == b->ctime.tv_sec && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+// The hash chain a file's entry lives on.
+static uint32_t *
+cdhashd_cache_bucket(cdhashd *service, const cdhashd_file_id *file) {
+    uint64_t h = ((uint64_t)file->dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)file->ino;
+    h *= 0xff51afd7ed558ccdull;
+    return &service->cache_buckets[(h >> 32) & service->cache_mask];
+}
+
+// Find the entry for a file, current or not. Must be called with the cache lock held.
+static uint32_t
+cdhashd_cache_find(cdhashd *service, const cdhashd_file_id *file) {
+    uint32_t i = *cdhashd_cache_bucket(service, file);
+    while (i != CDHASHD_CACHE_NIL
+            && (service->cache[i].file.dev != file->dev
+                || service->cache[i].file.ino != file->ino)) {
+        i = service->cache[i].hash_next;
+    }
+    return i;
+}
+
+static void
+cdhashd_lru_unlink(cdhashd *service, uint32_t i) {
+    cdhashd_cache_entry *entry = &service->cache[i];
+    if (entry->lru_prev != CDHASHD_CACHE_NIL) {
+        service->cache[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        service->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != CDHASHD_CACHE_NIL) {
+        service->cache[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        service->lru_tail = entry->lru_prev;
+    }
+}
+
+static void
+cdhashd_lru_push(cdhashd *service, uint32_t i) {
+    cdhashd_cache_entry *entry = &service->cache[i];
+    entry->lru_prev = CDHASHD_CACHE_NIL;
+    entry->lru_next = service->lru_head;
+    if (service->lru_head != CDHASHD_CACHE_NIL) {
+        service->cache[service->lru_head].lru_prev = i;
+    } else {
+        service->lru_tail = i;
+    }
+    service->lru_head = i;
+}
+
+// Take the least recently used entry off its hash chain and the LRU list for reuse.
+static uint32_t
+cdhashd_cache_evict(cdhashd *service) {
+    uint32_t i = service->lru_tail;
+    cdhashd_lru_unlink(service, i);
+    uint32_t *p = cdhashd_cache_bucket(service, &service->cache[i].file);
+    while (*p != i) {
+        p = &service->cache[*p].hash_next;
+    }
+    *p = service->cache[i].hash_next;
+    return i;
+}
+
+static bool
+cdhashd_cache_get(cdhashd *service, const cdhashd_file_id *file, uint8_t *cdhash) {
+    pthread_mutex_lock(&service->cache_lock);
+    uint32_t i = cdhashd_cache_find(service, file);
+    bool hit = (i != CDHASHD_CACHE_NIL && cdhashd_file_id_equal(&service->cache[i].file, file));
+    if (hit) {
+        memcpy(cdhash, service->cache[i].cdhash, CS_CDHASH_LEN);
+        cdhashd_lru_unlink(service, i);
+        cdhashd_lru_push(service, i);
+    }
+    pthread_mutex_unlock(&service->cache_lock);
+    return hit;
+}
+
+// Remember a file's cdhash, replacing what we had for an older version of the file or
+// evicting the least recently used entry if the cache is full.
+static void
+cdhashd_cache_put(cdhashd *service, const cdhashd_file_id *file, const uint8_t *cdhash) {
+    pthread_mutex_lock(&service->cache_lock);
+    uint32_t i = cdhashd_cache_find(service, file);
+    if (i != CDHASHD_CACHE_NIL) {
+        cdhashd_lru_unlink(service, i);
+    } else {
+        if (service->cache_count < service->config.cache_entries) {
+            i = service->cache_count++;
+        } else {
+            i = cdhashd_cache_evict(service);
+        }
+        uint32_t *bucket = cdhashd_cache_bucket(service, file);
+        service->cache[i].hash_next = *bucket;
+        *bucket = i;
+    }
+    service->cache[i].file = *file;
+    memcpy(service->cache[i].cdhash, cdhash, CS_CDHASH_LEN);
+    cdhashd_lru_push(service, i);
+    pthread_mutex_unlock(&service->cache_lock);
+}
+
+// Get the cdhash of a file, from the cache if it hasn't changed. Entries are only stored
+// under the fstat() identity of the descriptor that was hashed, and a file that changes while
+// we hash it fails, so an entry's identity always describes the bytes its cdhash covers. A hit
+// then only needs the path to name a file with that identity now, which stat() can tell
+// without opening it.
+static bool
+cdhashd_lookup(cdhashd *service, const char *path, uint8_t *cdhash) {
+    struct stat st;
+    cdhashd_file_id before, after;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    cdhashd_file_id_init(&before, &st);
+    if (cdhashd_cache_get(service, &before, cdhash)) {
+        __atomic_fetch_add(&service->hits, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    __atomic_fetch_add(&service->misses, 1, __ATOMIC_RELAXED);
+    file_source *src = file_source_open_path(path);
+    if (src == NULL) {
+        return false;
+    }
+    bool ok = file_source_stat(src, &st);
+    if (ok) {
+        cdhashd_file_id_init(&before, &st);
+        ok = compute_cdhash_source(src, cdhash) && file_source_stat(src, &st);
+    }
+    file_source_close(src);
+    if (!ok) {
+        return false;
+    }
+    cdhashd_file_id_init(&after, &st);
+    if (!cdhashd_file_id_equal(&before, &after)) {
+        return false;
+    }
+    cdhashd_cache_put(service, &after, cdhash);
+    return true;
+}
+
+static void *
+cdhashd_worker(void *arg) {
+    cdhashd *service = arg;
+    for (;;) {
+        cdh_client *client;
+        cdhashd_job *job = cdh_sched_next(service->sched, &client);
+        if (job == NULL) {
+            break;
+        }
+        cdhashd_reply reply = { .tag = job->tag };
+        reply.status = (cdhashd_lookup(service, job->path, reply.cdhash)
+                ? CDHASHD_STATUS_OK : CDHASHD_STATUS_ERROR);
+        cdhashd_send_reply(job->conn, &reply);
+        cdh_sched_complete(service->sched, client);
+        cdhashd_conn_unref(job->conn);
+        free(job);
+    }
+    return NULL;
+}
+
+// ---- Service ----------------------------------------------------------------------------------
+
+cdhashd *
+cdhashd_start(const cdhashd_config *config) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (config->workers == 0 || config->cache_entries == 0
+            || config->cache_entries == CDHASHD_CACHE_NIL
+            || strlen(config->socket_path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, config->socket_path);
+    cdhashd *service = calloc(1, sizeof(*service));
+    if (service == NULL) {
+        return NULL;
+    }
+    service->config = *config;
+    if (service->config.classify == NULL) {
+        service->config.classify = cdhashd_default_classify;
+    }
+    service->listen_fd = -1;
+    service->wake_pipe[0] = service->wake_pipe[1] = -1;
+    pthread_mutex_init(&service->lock, NULL);
+    pthread_cond_init(&service->conns_gone, NULL);
+    pthread_mutex_init(&service->cache_lock, NULL);
+    service->sched = cdh_sched_create(cdhashd_free_job);
+    service->cache = calloc(config->cache_entries, sizeof(*service->cache));
+    uint32_t buckets = 1;
+    while (buckets < config->cache_entries && buckets < (1u << 31)) {
+        buckets <<= 1;
+    }
+    service->cache_buckets = malloc((size_t)buckets * sizeof(*service->cache_buckets));
+    service->cache_mask = buckets - 1;
+    service->lru_head = service->lru_tail = CDHASHD_CACHE_NIL;
+    service->workers = calloc(config->workers, sizeof(*service->workers));
+    if (service->sched == NULL || service->cache == NULL || service->cache_buckets == NULL
+            || service->workers == NULL || pipe(service->wake_pipe) != 0) {
+        goto fail;
+    }
+    memset(service->cache_buckets, 0xff, (size_t)buckets * sizeof(*service->cache_buckets));
+    service->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(config->socket_path);
+    // Nobody can connect before listen(), so there is no window with the default mode.
+    if (service->listen_fd < 0
+            || bind(service->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || chmod(config->socket_path, config->socket_mode ? config->socket_mode : 0600) != 0
+            || listen(service->listen_fd, 64) != 0) {
+        goto fail;
+    }
+    unsigned started = 0;
+    while (started < config->workers
+            && pthread_create(&service->workers[started], NULL, cdhashd_worker, service) == 0) {
+        started++;
+    }
+    if (started < config->workers
+            || pthread_create(&service->accept_thread, NULL, cdhashd_acceptor, service) != 0) {
+        cdh_sched_shutdown(service->sched);
+        for (unsigned i = 0; i < started; i++) {
+            pthread_join(service->workers[i], NULL);
+        }
+        goto fail;
+    }
+    return service;
+fail:
+    if (service->listen_fd >= 0) {
+        close(service->listen_fd);
+    }
+    if (service->wake_pipe[0] >= 0) {
+        close(service->wake_pipe[0]);
+        close(service->wake_pipe[1]);
+    }
+    cdh_sched_destroy(service->sched);
+    free(service->cache);
+    free(service->cache_buckets);
+    free(service->workers);
+    pthread_mutex_destroy(&service->cache_lock);
+    pthread_cond_destroy(&service->conns_gone);
+    pthread_mutex_destroy(&service->lock);
+    free(service);
+    return NULL;
+}
+
+void
+cdhashd_stop(cdhashd *service) {
+    // Stop accepting, then disconnect everyone and let the jobs in service drain.
+    char c = 0;
+    ssize_t n = write(service->wake_pipe[1], &c, 1);
+    (void)n;
+    pthread_join(service->accept_thread, NULL);
+    close(service->listen_fd);
+    unlink(service->config.socket_path);
+    pthread_mutex_lock(&service->lock);
+    for (cdhashd_conn *conn = service->conns; conn != NULL; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+        // Readers held back by a quota and writers waiting on a ring don't see the shutdown.
+        pthread_mutex_lock(&conn->out_lock);
+        conn->closing = true;
+        pthread_cond_signal(&conn->out_ready);
+        pthread_cond_signal(&conn->out_space);
+        pthread_mutex_unlock(&conn->out_lock);
+    }
+    while (service->conns != NULL) {
+        pthread_cond_wait(&service->conns_gone, &service->lock);
+    }
+    pthread_mutex_unlock(&service->lock);
+    cdh_sched_shutdown(service->sched);
+    for (unsigned i = 0; i < service->config.workers; i++) {
+        pthread_join(service->workers[i], NULL);
+    }
+    close(service->wake_pipe[0]);
+    close(service->wake_pipe[1]);
+    cdh_sched_destroy(service->sched);
+    free(service->cache);
+    free(service->cache_buckets);
+    free(service->workers);
+    pthread_mutex_destroy(&service->cache_lock);
+    pthread_cond_destroy(&service->conns_gone);
+    pthread_mutex_destroy(&service->lock);
+    free(service);
+}
+
+void
+cdhashd_report(cdhashd *service, FILE *out) {
+    uint64_t hits = __atomic_load_n(&service->hits, __ATOMIC_RELAXED);
+    uint64_t misses = __atomic_load_n(&service->misses, __ATOMIC_RELAXED);
+    fprintf(out, "cache: %llu hits, %llu misses (%.1f%%)\n", (unsigned long long)hits,
+            (unsigned long long)misses,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    cdh_sched_report(service->sched, out);
+}
@@ -0,0 +1,100 @@
+
+#ifndef cdhashd_h
+#define cdhashd_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "cdhsched.h"
+#include "cs_blobs.h"
+
+/*
+ * The local cdhash service computes cdhashes on behalf of other processes over a Unix socket
+ * and keeps the most recently used ones, keyed by the device, inode, size, mtime and ctime of
+ * the file descriptor each was computed from.
+ * Requests are scheduled per client with cdhsched, so a bulk scanner can't starve the amfid
+ * handler.
+ *
+ * The service opens files with its own privileges, so anyone who can connect can learn
+ * whether any file it can read exists and what its cdhash is. The socket is therefore only
+ * accessible to the service's own user unless socket_mode says otherwise.
+ *
+ * Protocol: the client writes a cdhashd_request_header followed by length bytes of path (no
+ * terminator). For CDHASHD_OP_HASH the service writes back one cdhashd_reply carrying the
+ * same tag; replies may arrive out of order. CDHASHD_OP_SET_CLASS moves the client to the
+ * class in tag and has no reply; a client may only lower its own priority. All fields are in
+ * host byte order.
+ */
+#define CDHASHD_MAX_PATH 1024
+
+enum {
+    CDHASHD_OP_HASH = 1,
+    CDHASHD_OP_SET_CLASS = 2,
+    CDHASHD_OP_ATTACH_RING = 3,     // see cdhring.h
+};
+
+enum {
+    CDHASHD_STATUS_OK = 0,
+    CDHASHD_STATUS_ERROR = 1,
+};
+
+typedef struct cdhashd_request_header {
+    uint32_t op;
+    uint32_t tag;
+    uint32_t length;
+} cdhashd_request_header;
+
+typedef struct cdhashd_reply {
+    uint32_t tag;
+    uint32_t status;
+    uint8_t cdhash[CS_CDHASH_LEN];
+} cdhashd_reply;
+
+/*
+ * cdhashd_classify
+ *
+ * Description:
+ *     Decide the scheduling parameters of a new client from its credentials. max_queued
+ *     bounds both the client's requests waiting for a worker and its replies waiting to be
+ *     written; the service stops reading from a client that is over either.
+ */
+typedef void (*cdhashd_classify)(uid_t uid, pid_t pid, cdh_class *class, unsigned *weight,
+        unsigned *max_inflight, unsigned *max_queued);
+
+typedef struct cdhashd_config {
+    const char *socket_path;
+    mode_t socket_mode;             // 0 => 0600
+    unsigned workers;
+    uint32_t cache_entries;         // capacity of the cdhash cache
+    cdhashd_classify classify;      // NULL => root is interactive, everyone else normal
+} cdhashd_config;
+
+typedef struct cdhashd cdhashd;
+
+/*
+ * cdhashd_start
+ *
+ * Description:
+ *     Bind the socket and start serving. Returns NULL on failure.
+ */
+cdhashd *cdhashd_start(const cdhashd_config *config);
+
+/*
+ * cdhashd_stop
+ *
+ * Description:
+ *     Disconnect all clients, stop the workers and free the service.
+ */
+void cdhashd_stop(cdhashd *service);
+
+/*
+ * cdhashd_report
+ *
+ * Description:
+ *     Print the per-client scheduling metrics and the cache hit rate.
+ */
+void cdhashd_report(cdhashd *service, FILE *out);
+
+#endif /* cdhashd_h */
@@ -0,0 +1,480 @@
+
+/*
+ * cdhash service benchmark
+ * ------------------------
+ *
+ *  Runs cdhashd in-process and drives it with two clients: a bulk client that keeps a window
+ *  of requests pipelined, the way a scanner would, and an interactive client that sends one
+ *  request at a time with a pause in between, the way the amfid handler does. The run is
+ *  made twice, once with the interactive client in the interactive class and once with it
+ *  demoted to the bulk client's class, so the second run shows what the priority classes buy.
+ *  A third run has two bulk clients of unequal weights in the same class; when the heavier one
+ *  is done, the lighter one should have had about its share of the workers.
+ *
+ *  The scheduler's per-client table is printed at the end of each run, while the clients are
+ *  still connected.
+ *
+ *  Build it with `make cdhashd_bench` and run it against one or more signed Mach-O files:
+ *
+ *      cdhashd_bench [-w workers] [-c cache_entries] [-n bulk_requests] [-d bulk_window]
+ *          [-i interactive_requests] [-p interactive_pause_us] [-W heavy_weight] [-P] file...
+ *
+ *  With fewer cache entries than files, every request is a miss and the workers spend their
+ *  time hashing, which is where the classes make the most difference.
+ *
+ *  -P prints the per-stage performance counters after each run. It needs a build with them,
+ *  `make clean && make PERFCTR=1 cdhashd_bench`.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdhashd.h"
+#include "perfctr.h"
+
+// The bulk window must fit in this, or the bulk client deadlocks itself: it only reads
+// replies once its window is full, and the service stops reading from it at the quota.
+#define BENCH_MAX_QUEUED 256
+
+typedef struct bench_options {
+    unsigned workers;
+    unsigned cache_entries;
+    unsigned bulk_requests;
+    unsigned bulk_window;
+    unsigned interactive_requests;
+    unsigned interactive_pause_us;
+    unsigned heavy_weight;
+    bool perfctr;
+    char *const *files;
+    unsigned file_count;
+} bench_options;
+
+// Holds finished clients connected until the run has printed the scheduler's table.
+typedef struct bench_sync {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned finished;
+    bool released;
+} bench_sync;
+
+typedef struct bench_client {
+    const bench_options *options;
+    bench_sync *sync;
+    int fd;
+    cdh_class class;
+    uint64_t *latencies_ns;         // interactive: per request
+    uint64_t received;
+    uint64_t elapsed_ns;
+    uint64_t failed;
+    bool ok;
+} bench_client;
+
+// The weights given to clients in the order they connect; the last one repeats.
+static unsigned bench_weights[2];
+static unsigned bench_weight_count;
+static unsigned bench_connections;
+
+static uint64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Everyone starts out interactive; the clients move themselves down with SET_CLASS. The
+// service accepts connections one at a time, so clients connected one after another get
+// their weights in that order.
+static void
+bench_classify(uid_t uid, pid_t pid, cdh_class *class, unsigned *weight,
+        unsigned *max_inflight, unsigned *max_queued) {
+    (void)uid; (void)pid;
+    unsigned n = bench_connections++;
+    *class = CDH_CLASS_INTERACTIVE;
+    *weight = bench_weights[n < bench_weight_count ? n : bench_weight_count - 1];
+    *max_inflight = 4;
+    *max_queued = BENCH_MAX_QUEUED;
+}
+
+static void
+bench_set_weights(unsigned first, unsigned rest) {
+    bench_weights[0] = first;
+    bench_weights[1] = rest;
+    bench_weight_count = 2;
+    bench_connections = 0;
+}
+
+// Report a client done and wait for the run to release it.
+static void
+bench_finish(bench_client *client) {
+    bench_sync *sync = client->sync;
+    pthread_mutex_lock(&sync->lock);
+    sync->finished++;
+    pthread_cond_broadcast(&sync->cond);
+    while (!sync->released) {
+        pthread_cond_wait(&sync->cond, &sync->lock);
+    }
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static void
+bench_wait_finished(bench_sync *sync, unsigned count) {
+    pthread_mutex_lock(&sync->lock);
+    while (sync->finished < count) {
+        pthread_cond_wait(&sync->cond, &sync->lock);
+    }
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static void
+bench_release(bench_sync *sync) {
+    pthread_mutex_lock(&sync->lock);
+    sync->released = true;
+    pthread_cond_broadcast(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static int
+bench_connect(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+bench_send(int fd, uint32_t op, uint32_t tag, const char *path) {
+    cdhashd_request_header header = { .op = op, .tag = tag, .length = (uint32_t)strlen(path) };
+    uint8_t buf[sizeof(header) + CDHASHD_MAX_PATH];
+    if (header.length > CDHASHD_MAX_PATH) {
+        return false;
+    }
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), path, header.length);
+    size_t length = sizeof(header) + header.length;
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = write(fd, buf + sent, length - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+static bool
+bench_receive(int fd, cdhashd_reply *reply) {
+    uint8_t *p = (uint8_t *)reply;
+    size_t length = sizeof(*reply);
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Keep bulk_window requests outstanding until bulk_requests have been answered.
+static void *
+bench_bulk_client(void *arg) {
+    bench_client *client = arg;
+    const bench_options *options = client->options;
+    int fd = client->fd;
+    if (!bench_send(fd, CDHASHD_OP_SET_CLASS, client->class, "")) {
+        goto out;
+    }
+    uint64_t start = bench_now_ns();
+    unsigned sent = 0, received = 0;
+    while (received < options->bulk_requests) {
+        while (sent < options->bulk_requests && sent - received < options->bulk_window) {
+            if (!bench_send(fd, CDHASHD_OP_HASH, sent,
+                    options->files[sent % options->file_count])) {
+                goto out;
+            }
+            sent++;
+        }
+        cdhashd_reply reply;
+        if (!bench_receive(fd, &reply)) {
+            goto out;
+        }
+        if (reply.status != CDHASHD_STATUS_OK) {
+            client->failed++;
+        }
+        received++;
+        __atomic_store_n(&client->received, received, __ATOMIC_RELAXED);
+    }
+    client->elapsed_ns = bench_now_ns() - start;
+    client->ok = true;
+out:
+    bench_finish(client);
+    return NULL;
+}
+
+// Send one request at a time, recording how long each takes.
+static void *
+bench_interactive_client(void *arg) {
+    bench_client *client = arg;
+    const bench_options *options = client->options;
+    int fd = client->fd;
+    if (!bench_send(fd, CDHASHD_OP_SET_CLASS, client->class, "")) {
+        goto out;
+    }
+    uint64_t start = bench_now_ns();
+    for (unsigned i = 0; i < options->interactive_requests; i++) {
+        usleep(options->interactive_pause_us);
+        uint64_t sent = bench_now_ns();
+        cdhashd_reply reply;
+        if (!bench_send(fd, CDHASHD_OP_HASH, i, options->files[i % options->file_count])
+                || !bench_receive(fd, &reply)) {
+            goto out;
+        }
+        client->latencies_ns[i] = bench_now_ns() - sent;
+        if (reply.status != CDHASHD_STATUS_OK) {
+            client->failed++;
+        }
+    }
+    client->elapsed_ns = bench_now_ns() - start;
+    client->ok = true;
+out:
+    bench_finish(client);
+    return NULL;
+}
+
+static int
+bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static cdhashd *
+bench_start_service(const bench_options *options, char *socket_path, size_t size) {
+    snprintf(socket_path, size, "/tmp/cdhashd_bench.%d", (int)getpid());
+    cdhashd_config config = {
+        .socket_path = socket_path,
+        .workers = options->workers,
+        .cache_entries = options->cache_entries,
+        .classify = bench_classify,
+    };
+    cdhashd *service = cdhashd_start(&config);
+    if (service == NULL) {
+        fprintf(stderr, "cdhashd_bench: can't start the service on %s\n", socket_path);
+    }
+    perfctr_reset();
+    return service;
+}
+
+// Print the service's tables while the clients are still connected, then let them go.
+static void
+bench_report(cdhashd *service, const bench_options *options, bench_sync *sync) {
+    cdhashd_report(service, stdout);
+    if (options->perfctr) {
+        perfctr_report(stdout);
+    }
+    bench_release(sync);
+}
+
+// One run of a bulk and an interactive client against a fresh service.
+static bool
+bench_run(const bench_options *options, cdh_class interactive_class) {
+    char socket_path[64];
+    printf("interactive client in the %s class:\n",
+            interactive_class == CDH_CLASS_BULK ? "bulk" : "interactive");
+    bench_set_weights(1, 1);
+    cdhashd *service = bench_start_service(options, socket_path, sizeof(socket_path));
+    if (service == NULL) {
+        return false;
+    }
+    bench_sync sync = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+    };
+    uint64_t *latencies = calloc(options->interactive_requests, sizeof(*latencies));
+    bench_client bulk = {
+        .options = options, .sync = &sync, .class = CDH_CLASS_BULK,
+        .fd = bench_connect(socket_path),
+    };
+    bench_client interactive = {
+        .options = options, .sync = &sync, .class = interactive_class,
+        .latencies_ns = latencies, .fd = -1,
+    };
+    pthread_t bulk_thread, interactive_thread;
+    bool ok = (latencies != NULL && bulk.fd >= 0
+            && pthread_create(&bulk_thread, NULL, bench_bulk_client, &bulk) == 0);
+    if (ok) {
+        // Let the bulk client fill its window first.
+        usleep(20000);
+        interactive.fd = bench_connect(socket_path);
+        if (interactive.fd >= 0 && pthread_create(&interactive_thread, NULL,
+                bench_interactive_client, &interactive) == 0) {
+            bench_wait_finished(&sync, 2);
+            bench_report(service, options, &sync);
+            pthread_join(interactive_thread, NULL);
+        } else {
+            bench_release(&sync);
+        }
+        pthread_join(bulk_thread, NULL);
+    }
+    ok = ok && bulk.ok && interactive.ok;
+    if (ok) {
+        unsigned count = options->interactive_requests;
+        uint64_t total = 0;
+        for (unsigned i = 0; i < count; i++) {
+            total += latencies[i];
+        }
+        qsort(latencies, count, sizeof(*latencies), bench_compare_u64);
+        printf("  interactive: %u requests, %llu failed, latency avg %.1f us, p50 %.1f us, "
+                "p99 %.1f us, max %.1f us\n", count, (unsigned long long)interactive.failed,
+                total / 1e3 / count, latencies[count / 2] / 1e3,
+                latencies[(count * 99) / 100] / 1e3, latencies[count - 1] / 1e3);
+        printf("  bulk: %u requests, %llu failed, %.0f requests/s\n", options->bulk_requests,
+                (unsigned long long)bulk.failed, options->bulk_requests * 1e9 / bulk.elapsed_ns);
+    } else {
+        fprintf(stderr, "cdhashd_bench: a client failed\n");
+    }
+    if (bulk.fd >= 0) {
+        close(bulk.fd);
+    }
+    if (interactive.fd >= 0) {
+        close(interactive.fd);
+    }
+    free(latencies);
+    cdhashd_stop(service);
+    return ok;
+}
+
+// One run of two bulk clients in the same class, the first of weight heavy_weight and the
+// second of weight 1. The table is printed as soon as one of them is done, while the other is
+// still being served.
+static bool
+bench_run_weighted(const bench_options *options) {
+    char socket_path[64];
+    printf("two bulk clients of weights %u and 1:\n", options->heavy_weight);
+    bench_set_weights(options->heavy_weight, 1);
+    cdhashd *service = bench_start_service(options, socket_path, sizeof(socket_path));
+    if (service == NULL) {
+        return false;
+    }
+    bench_sync sync = {
+        .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+    };
+    bench_client clients[2];
+    pthread_t threads[2];
+    bool started[2] = { false, false };
+    for (int i = 0; i < 2; i++) {
+        clients[i] = (bench_client) {
+            .options = options, .sync = &sync, .class = CDH_CLASS_BULK,
+            .fd = bench_connect(socket_path),
+        };
+    }
+    bool ok = (clients[0].fd >= 0 && clients[1].fd >= 0);
+    for (int i = 0; ok && i < 2; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, bench_bulk_client, &clients[i]) == 0);
+        ok = started[i];
+    }
+    if (ok) {
+        bench_wait_finished(&sync, 1);
+        uint64_t heavy = __atomic_load_n(&clients[0].received, __ATOMIC_RELAXED);
+        uint64_t light = __atomic_load_n(&clients[1].received, __ATOMIC_RELAXED);
+        printf("  when the first was done, weight %u: %llu replies, weight 1: %llu replies, "
+                "ratio %.2f\n",
+                options->heavy_weight, (unsigned long long)heavy, (unsigned long long)light,
+                light ? (double)heavy / light : 0.0);
+        cdhashd_report(service, stdout);
+        bench_wait_finished(&sync, 2);
+        if (options->perfctr) {
+            perfctr_report(stdout);
+        }
+        bench_release(&sync);
+    } else {
+        bench_release(&sync);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        ok = ok && clients[i].ok;
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "cdhashd_bench: a client failed\n");
+    }
+    cdhashd_stop(service);
+    return ok;
+}
+
+static void
+bench_usage(void) {
+    fprintf(stderr, "usage: cdhashd_bench [-w workers] [-c cache_entries] [-n bulk_requests] "
+            "[-d bulk_window] [-i interactive_requests] [-p interactive_pause_us] "
+            "[-W heavy_weight] [-P] file...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv) {
+    bench_options options = {
+        .workers = 2,
+        .cache_entries = 4096,
+        .bulk_requests = 200000,
+        .bulk_window = 128,
+        .interactive_requests = 1000,
+        .interactive_pause_us = 1000,
+        .heavy_weight = 4,
+    };
+    int ch;
+    while ((ch = getopt(argc, argv, "w:c:n:d:i:p:W:P")) != -1) {
+        unsigned value = (optarg != NULL ? (unsigned)strtoul(optarg, NULL, 0) : 0);
+        switch (ch) {
+            case 'w': options.workers = value; break;
+            case 'c': options.cache_entries = value; break;
+            case 'n': options.bulk_requests = value; break;
+            case 'd': options.bulk_window = value; break;
+            case 'i': options.interactive_requests = value; break;
+            case 'p': options.interactive_pause_us = value; break;
+            case 'W': options.heavy_weight = value; break;
+            case 'P': options.perfctr = true; break;
+            default: bench_usage();
+        }
+    }
+#ifndef CDHASH_PERFCTR
+    if (options.perfctr) {
+        fprintf(stderr, "cdhashd_bench: -P needs a build with CDHASH_PERFCTR "
+                "(make clean && make PERFCTR=1)\n");
+        return 2;
+    }
+#endif
+    if (optind == argc || options.workers == 0 || options.cache_entries == 0
+            || options.bulk_window == 0
+            || options.bulk_window > BENCH_MAX_QUEUED
+            || options.interactive_requests == 0 || options.heavy_weight == 0) {
+        bench_usage();
+    }
+    options.files = argv + optind;
+    options.file_count = (unsigned)(argc - optind);
+    bool ok = bench_run(&options, CDH_CLASS_INTERACTIVE)
+        && bench_run(&options, CDH_CLASS_BULK)
+        && bench_run_weighted(&options);
+    return ok ? 0 : 1;
+}
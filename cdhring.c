@@ -0,0 +1,697 @@
+
+/*
+ * Shared-memory ring transport
+ * ----------------------------
+ *
+ *  The region starts with a header of indices, followed by the request ring, the reply ring
+ *  and the path arena. Each index is written by one side only: the client owns the request
+ *  head and the reply tail, the service owns the request tail and the reply head. The arena
+ *  is a byte ring managed by the client; a request's path stays valid until the service has
+ *  moved the request tail past it.
+ *
+ *  Sleeping uses the usual flag protocol: the sleeper sets its flag, re-checks for work, and
+ *  only then blocks on its wakeup fd; the other side publishes work and then wakes the
+ *  sleeper if its flag is set. Sequentially consistent fences between the two steps on each
+ *  side keep a wakeup from being lost.
+ *
+ *  The service maps memory the client can resize. If the client shrank the region, the next
+ *  access from the service would raise SIGBUS and take the whole service down. On Linux the
+ *  region is a memfd and the service only accepts it sealed against shrinking. Elsewhere
+ *  every service access to the region runs under a SIGBUS handler that fails the ring
+ *  instead.
+ *
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE         // memfd_create, F_ADD_SEALS
+#include <sys/eventfd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(F_SEAL_SHRINK)
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#define CDHRING_CATCH_SIGBUS 1
+#endif
+
+#include "cdhring.h"
+
+#define CDHRING_MAGIC 0x63646872    // 'cdhr'
+
+typedef struct cdhring_header {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t arena_size;
+    uint32_t reserved;
+    _Atomic uint64_t request_head;      // client
+    _Atomic uint64_t request_tail;      // service
+    _Atomic uint64_t reply_head;        // service
+    _Atomic uint64_t reply_tail;        // client
+    _Atomic uint32_t client_sleeping;
+    _Atomic uint32_t service_wants_requests;
+    _Atomic uint32_t service_wants_space;
+} cdhring_header;
+
+typedef struct cdhring_request {
+    uint32_t tag;
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t reserved;
+} cdhring_request;
+
+// Where each part of the region lives.
+typedef struct cdhring_layout {
+    cdhring_header *header;
+    cdhring_request *requests;
+    cdhashd_reply *replies;
+    char *arena;
+    size_t size;
+} cdhring_layout;
+
+static size_t
+cdhring_region_size(uint32_t slots, uint32_t arena_size) {
+    return sizeof(cdhring_header) + (size_t)slots * sizeof(cdhring_request)
+        + (size_t)slots * sizeof(cdhashd_reply) + arena_size;
+}
+
+static void
+cdhring_layout_init(cdhring_layout *layout, void *region, uint32_t slots) {
+    uint8_t *p = region;
+    layout->header = region;
+    layout->requests = (cdhring_request *)(p + sizeof(cdhring_header));
+    layout->replies = (cdhashd_reply *)(layout->requests + slots);
+    layout->arena = (char *)(layout->replies + slots);
+}
+
+// ---- Wakeups ----------------------------------------------------------------------------------
+
+// Create a wakeup channel. With eventfd both ends are the same fd.
+static bool
+cdhring_wake_create(int *read_fd, int *write_fd) {
+#if defined(__linux__)
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    *read_fd = *write_fd = fd;
+    return true;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *read_fd = fds[0];
+    *write_fd = fds[1];
+    return true;
+#endif
+}
+
+static void
+cdhring_wake_close(int read_fd, int write_fd) {
+    if (read_fd >= 0) {
+        close(read_fd);
+    }
+    if (write_fd >= 0 && write_fd != read_fd) {
+        close(write_fd);
+    }
+}
+
+static void
+cdhring_wake(int write_fd) {
+    uint64_t one = 1;
+    // A full pipe or saturated eventfd already means "wake up".
+    ssize_t n = write(write_fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void
+cdhring_wake_drain(int read_fd) {
+    uint64_t buf[8];
+    while (read(read_fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void
+cdhring_wait(int read_fd) {
+    struct pollfd pfd = { .fd = read_fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+    }
+    cdhring_wake_drain(read_fd);
+}
+
+// ---- Client -----------------------------------------------------------------------------------
+
+struct cdhring_client {
+    cdhring_layout layout;
+    uint32_t mask;
+    uint64_t request_head;
+    uint64_t reply_tail;
+    uint32_t arena_head;            // where the next path goes
+    uint32_t *arena_start;          // per request slot: where its path is
+    int to_service;                 // write end: requests queued
+    int to_writer;                  // write end: reply slots freed
+    int from_service;               // read end
+    int service_ends[3];            // the ends handed to the service
+};
+
+// Create the shared region. On Linux it is a memfd sealed at its size. Elsewhere it is a
+// POSIX shared memory object whose name is unlinked right away; the fd is what gets shared.
+static int
+cdhring_shm_create(size_t size) {
+#if defined(F_SEAL_SHRINK)
+    int fd = memfd_create("cdhring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0
+            || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    static _Atomic unsigned counter;
+    char name[32];
+    for (int attempt = 0; attempt < 16; attempt++) {
+        snprintf(name, sizeof(name), "/cdhring.%d.%u", (int)getpid(),
+                atomic_fetch_add(&counter, 1));
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            return -1;
+        }
+        shm_unlink(name);
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    return -1;
+#endif
+}
+
+// Send the attach request with the region and wakeup fds attached.
+static bool
+cdhring_send_attach(int socket_fd, const int *fds, int count) {
+    cdhashd_request_header header = { .op = CDHASHD_OP_ATTACH_RING };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(count * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    ssize_t n;
+    while ((n = sendmsg(socket_fd, &msg, 0)) < 0 && errno == EINTR) {
+    }
+    return n == (ssize_t)sizeof(header);
+}
+
+cdhring_client *
+cdhring_connect(int socket_fd, uint32_t slots, uint32_t arena_size) {
+    if (slots == 0 || (slots & (slots - 1)) != 0 || slots > (1u << 20)
+            || arena_size < CDHASHD_MAX_PATH) {
+        return NULL;
+    }
+    cdhring_client *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->to_service = ring->to_writer = ring->from_service = -1;
+    ring->service_ends[0] = ring->service_ends[1] = ring->service_ends[2] = -1;
+    ring->mask = slots - 1;
+    ring->arena_start = calloc(slots, sizeof(*ring->arena_start));
+    size_t size = cdhring_region_size(slots, arena_size);
+    int shm_fd = cdhring_shm_create(size);
+    void *region = MAP_FAILED;
+    if (ring->arena_start == NULL || shm_fd < 0) {
+        goto fail;
+    }
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (region == MAP_FAILED
+            || !cdhring_wake_create(&ring->service_ends[0], &ring->to_service)
+            || !cdhring_wake_create(&ring->service_ends[1], &ring->to_writer)
+            || !cdhring_wake_create(&ring->from_service, &ring->service_ends[2])) {
+        goto fail;
+    }
+    cdhring_layout_init(&ring->layout, region, slots);
+    ring->layout.size = size;
+    ring->layout.header->magic = CDHRING_MAGIC;
+    ring->layout.header->slots = slots;
+    ring->layout.header->arena_size = arena_size;
+    // The service gets the region, the read ends of its two wakeups and the write end of ours.
+    int fds[4] = { shm_fd, ring->service_ends[0], ring->service_ends[1], ring->service_ends[2] };
+    if (!cdhring_send_attach(socket_fd, fds, 4)) {
+        goto fail;
+    }
+    close(shm_fd);
+    // With pipes, the service's ends are now its own; with eventfd they are shared.
+    if (ring->service_ends[0] != ring->to_service) {
+        close(ring->service_ends[0]);
+    }
+    if (ring->service_ends[1] != ring->to_writer) {
+        close(ring->service_ends[1]);
+    }
+    if (ring->service_ends[2] != ring->from_service) {
+        close(ring->service_ends[2]);
+    }
+    return ring;
+fail:
+    if (region != MAP_FAILED) {
+        munmap(region, size);
+    }
+    if (shm_fd >= 0) {
+        close(shm_fd);
+    }
+    cdhring_wake_close(ring->service_ends[0], ring->to_service);
+    cdhring_wake_close(ring->service_ends[1], ring->to_writer);
+    cdhring_wake_close(ring->from_service, ring->service_ends[2]);
+    free(ring->arena_start);
+    free(ring);
+    return NULL;
+}
+
+bool
+cdhring_submit(cdhring_client *ring, uint32_t tag, const char *path) {
+    cdhring_header *header = ring->layout.header;
+    size_t length = strlen(path);
+    if (length > CDHASHD_MAX_PATH) {
+        return false;
+    }
+    uint64_t tail = atomic_load_explicit(&header->request_tail, memory_order_acquire);
+    if (ring->request_head - tail > ring->mask) {
+        return false;
+    }
+    // The arena in use runs from the path of the oldest unconsumed request to arena_head.
+    // Keep arena_head from catching up with it, so that equal offsets always mean empty.
+    uint32_t arena_size = header->arena_size;
+    uint32_t offset = ring->arena_head;
+    if (tail == ring->request_head) {
+        offset = 0;
+    } else {
+        uint32_t arena_tail = ring->arena_start[tail & ring->mask];
+        if (offset >= arena_tail) {
+            if (arena_size - offset < length) {
+                if (length >= arena_tail) {
+                    return false;
+                }
+                offset = 0;
+            }
+        } else if (arena_tail - offset <= length) {
+            return false;
+        }
+    }
+    memcpy(ring->layout.arena + offset, path, length);
+    ring->arena_head = offset + (uint32_t)length;
+    cdhring_request *request = &ring->layout.requests[ring->request_head & ring->mask];
+    request->tag = tag;
+    request->path_offset = offset;
+    request->path_length = (uint32_t)length;
+    ring->arena_start[ring->request_head & ring->mask] = offset;
+    ring->request_head++;
+    atomic_store_explicit(&header->request_head, ring->request_head, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header->service_wants_requests, memory_order_relaxed)) {
+        atomic_store_explicit(&header->service_wants_requests, 0, memory_order_relaxed);
+        cdhring_wake(ring->to_service);
+    }
+    return true;
+}
+
+size_t
+cdhring_poll(cdhring_client *ring, cdhashd_reply *replies, size_t count, bool wait) {
+    cdhring_header *header = ring->layout.header;
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&header->reply_head, memory_order_acquire);
+        size_t n = 0;
+        while (ring->reply_tail != head && n < count) {
+            replies[n++] = ring->layout.replies[ring->reply_tail & ring->mask];
+            ring->reply_tail++;
+        }
+        if (n != 0) {
+            atomic_store_explicit(&header->reply_tail, ring->reply_tail, memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&header->service_wants_space, memory_order_relaxed)) {
+                atomic_store_explicit(&header->service_wants_space, 0, memory_order_relaxed);
+                cdhring_wake(ring->to_writer);
+            }
+            return n;
+        }
+        if (!wait) {
+            return 0;
+        }
+        atomic_store_explicit(&header->client_sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&header->reply_head, memory_order_relaxed) == ring->reply_tail) {
+            cdhring_wait(ring->from_service);
+        }
+        atomic_store_explicit(&header->client_sleeping, 0, memory_order_relaxed);
+    }
+}
+
+void
+cdhring_close(cdhring_client *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    munmap(ring->layout.header, ring->layout.size);
+    cdhring_wake_close(-1, ring->to_service);
+    cdhring_wake_close(-1, ring->to_writer);
+    cdhring_wake_close(ring->from_service, -1);
+    free(ring->arena_start);
+    free(ring);
+}
+
+// ---- Service ----------------------------------------------------------------------------------
+
+struct cdhring_service {
+    cdhring_layout layout;
+    uint32_t slots;
+    uint32_t mask;
+    uint32_t arena_size;
+    uint64_t request_tail;
+    uint64_t reply_head;
+    int request_fd;                 // the client queued requests
+    int space_fd;                   // the client freed reply slots
+    int wake_write_fd;
+    bool faulted;                   // the region went away under us
+};
+
+#if defined(CDHRING_CATCH_SIGBUS)
+
+// Where a service thread goes if the region it is accessing goes away under it.
+static _Thread_local sigjmp_buf *cdhring_fault_jump;
+static struct sigaction cdhring_previous_sigbus;
+static pthread_once_t cdhring_sigbus_once = PTHREAD_ONCE_INIT;
+
+static void
+cdhring_sigbus(int signo, siginfo_t *info, void *context) {
+    sigjmp_buf *jump = cdhring_fault_jump;
+    if (jump != NULL) {
+        cdhring_fault_jump = NULL;
+        siglongjmp(*jump, 1);
+    }
+    // Not a ring access: pass the fault on, or let it recur with the default action.
+    if (cdhring_previous_sigbus.sa_flags & SA_SIGINFO) {
+        cdhring_previous_sigbus.sa_sigaction(signo, info, context);
+    } else if (cdhring_previous_sigbus.sa_handler != SIG_DFL
+            && cdhring_previous_sigbus.sa_handler != SIG_IGN) {
+        cdhring_previous_sigbus.sa_handler(signo);
+    } else {
+        signal(SIGBUS, SIG_DFL);
+    }
+}
+
+static void
+cdhring_sigbus_install(void) {
+    struct sigaction action = {
+        .sa_sigaction = cdhring_sigbus,
+        .sa_flags = SA_SIGINFO | SA_NODEFER,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &cdhring_previous_sigbus);
+}
+
+// Bracket an access to the region. If it faults, the ring is marked failed and the enclosing
+// function returns failed. SA_NODEFER leaves SIGBUS unblocked in the handler, so the jump
+// needn't restore the signal mask. Guarded sections must not nest.
+#define CDHRING_GUARD(ring, failed)                 \
+    sigjmp_buf cdhring_jump;                        \
+    if (sigsetjmp(cdhring_jump, 0) != 0) {          \
+        (ring)->faulted = true;                     \
+        return (failed);                            \
+    }                                               \
+    cdhring_fault_jump = &cdhring_jump
+#define CDHRING_UNGUARD() (cdhring_fault_jump = NULL)
+
+#else
+
+#define CDHRING_GUARD(ring, failed) ((void)0)
+#define CDHRING_UNGUARD() ((void)0)
+
+#endif
+
+// The size of the region a header describes, or 0 if the header is invalid.
+static size_t
+cdhring_header_region_size(uint32_t magic, uint32_t slots, uint32_t arena_size) {
+    if (magic != CDHRING_MAGIC || slots == 0 || (slots & (slots - 1)) != 0
+            || slots > (1u << 20)) {
+        return 0;
+    }
+    return cdhring_region_size(slots, arena_size);
+}
+
+// Read the size of the region from a mapping of the header alone.
+static size_t
+cdhring_service_peek_size(cdhring_service *ring, const cdhring_header *header) {
+    CDHRING_GUARD(ring, 0);
+    size_t size = cdhring_header_region_size(header->magic, header->slots, header->arena_size);
+    CDHRING_UNGUARD();
+    return size;
+}
+
+// Take a private copy of the geometry; the client could change the header later.
+static bool
+cdhring_service_load_header(cdhring_service *ring, void *region, size_t size) {
+    CDHRING_GUARD(ring, false);
+    cdhring_header *header = region;
+    uint32_t slots = header->slots;
+    uint32_t arena_size = header->arena_size;
+    bool ok = (cdhring_header_region_size(header->magic, slots, arena_size) == size);
+    if (ok) {
+        cdhring_layout_init(&ring->layout, region, slots);
+        ring->slots = slots;
+        ring->mask = slots - 1;
+        ring->arena_size = arena_size;
+        ring->request_tail = atomic_load(&header->request_tail);
+        ring->reply_head = atomic_load(&header->reply_head);
+    }
+    CDHRING_UNGUARD();
+    return ok;
+}
+
+cdhring_service *
+cdhring_service_attach(int shm_fd, int request_fd, int space_fd, int wake_write_fd) {
+#if defined(F_SEAL_SHRINK)
+    // Only map a region that can't shrink. The seals go first: the size is fixed after that.
+    int seals = fcntl(shm_fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        return NULL;
+    }
+#else
+    pthread_once(&cdhring_sigbus_once, cdhring_sigbus_install);
+#endif
+    struct stat st;
+    if (fstat(shm_fd, &st) != 0 || (size_t)st.st_size < sizeof(cdhring_header)) {
+        return NULL;
+    }
+    cdhring_service *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    // Map the header alone to learn the size of the region, then map just the region. The
+    // object may be larger than that: Darwin rounds shared memory sizes up to a page.
+    size_t size = 0;
+    void *region = mmap(NULL, sizeof(cdhring_header), PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (region != MAP_FAILED) {
+        size = cdhring_service_peek_size(ring, region);
+        munmap(region, sizeof(cdhring_header));
+    }
+    region = MAP_FAILED;
+    if (size != 0 && size <= (size_t)st.st_size) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    }
+    if (region == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    if (!cdhring_service_load_header(ring, region, size)) {
+        munmap(region, size);
+        free(ring);
+        return NULL;
+    }
+    ring->layout.size = size;
+    ring->request_fd = request_fd;
+    ring->space_fd = space_fd;
+    ring->wake_write_fd = wake_write_fd;
+    fcntl(request_fd, F_SETFL, fcntl(request_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(space_fd, F_SETFL, fcntl(space_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(wake_write_fd, F_SETFL, fcntl(wake_write_fd, F_GETFL) | O_NONBLOCK);
+    return ring;
+}
+
+void
+cdhring_service_detach(cdhring_service *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    munmap(ring->layout.header, ring->layout.size);
+    cdhring_wake_close(ring->request_fd, -1);
+    cdhring_wake_close(ring->space_fd, -1);
+    cdhring_wake_close(-1, ring->wake_write_fd);
+    free(ring);
+}
+
+int
+cdhring_service_request_fd(cdhring_service *ring) {
+    return ring->request_fd;
+}
+
+void
+cdhring_service_wait_space(cdhring_service *ring, int timeout_ms) {
+    struct pollfd pfd = { .fd = ring->space_fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        cdhring_wake_drain(ring->space_fd);
+    }
+}
+
+// Wake the client if it is asleep. Returns false if the region went away.
+static bool
+cdhring_service_notify(cdhring_service *ring) {
+    if (ring->faulted) {
+        return false;
+    }
+    CDHRING_GUARD(ring, false);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool sleeping = atomic_load_explicit(&ring->layout.header->client_sleeping,
+            memory_order_relaxed);
+    CDHRING_UNGUARD();
+    if (sleeping) {
+        cdhring_wake(ring->wake_write_fd);
+    }
+    return true;
+}
+
+// Take the next request off the ring, copying it and its path out before looking at them.
+// Returns 1 if a request was taken, 0 if there is none, and -1 if the client corrupted the
+// ring or the region went away.
+static int
+cdhring_service_take(cdhring_service *ring, uint32_t *tag, char *path) {
+    if (ring->faulted) {
+        return -1;
+    }
+    CDHRING_GUARD(ring, -1);
+    cdhring_header *header = ring->layout.header;
+    int result = 0;
+    uint64_t head = atomic_load_explicit(&header->request_head, memory_order_acquire);
+    if (head - ring->request_tail > ring->slots) {
+        result = -1;
+    } else if (head != ring->request_tail) {
+        cdhring_request request = ring->layout.requests[ring->request_tail & ring->mask];
+        if (request.path_length > CDHASHD_MAX_PATH
+                || request.path_offset > ring->arena_size
+                || request.path_length > ring->arena_size - request.path_offset) {
+            result = -1;
+        } else {
+            memcpy(path, ring->layout.arena + request.path_offset, request.path_length);
+            path[request.path_length] = '\0';
+            *tag = request.tag;
+            // Free the slot before handing the request on, so that no reply can reach the
+            // client ahead of the space its request held.
+            ring->request_tail++;
+            atomic_store_explicit(&header->request_tail, ring->request_tail,
+                    memory_order_release);
+            result = 1;
+        }
+    }
+    CDHRING_UNGUARD();
+    return result;
+}
+
+bool
+cdhring_service_drain(cdhring_service *ring,
+        void (*handle)(void *context, uint32_t tag, const char *path), void *context) {
+    cdhring_wake_drain(ring->request_fd);
+    char path[CDHASHD_MAX_PATH + 1];
+    uint32_t tag;
+    bool consumed = false;
+    int taken;
+    while ((taken = cdhring_service_take(ring, &tag, path)) > 0) {
+        handle(context, tag, path);
+        consumed = true;
+    }
+    return taken == 0 && (!consumed || cdhring_service_notify(ring));
+}
+
+size_t
+cdhring_service_push(cdhring_service *ring, const cdhashd_reply *replies, size_t count) {
+    if (ring->faulted) {
+        return (size_t)-1;
+    }
+    CDHRING_GUARD(ring, (size_t)-1);
+    cdhring_header *header = ring->layout.header;
+    size_t n = (size_t)-1;
+    uint64_t tail = atomic_load_explicit(&header->reply_tail, memory_order_acquire);
+    if (ring->reply_head - tail <= ring->slots) {
+        n = 0;
+        while (n < count && ring->reply_head - tail < ring->slots) {
+            ring->layout.replies[ring->reply_head & ring->mask] = replies[n++];
+            ring->reply_head++;
+        }
+        if (n != 0) {
+            atomic_store_explicit(&header->reply_head, ring->reply_head, memory_order_release);
+        }
+    }
+    CDHRING_UNGUARD();
+    if (n != 0 && n != (size_t)-1 && !cdhring_service_notify(ring)) {
+        return (size_t)-1;
+    }
+    return n;
+}
+
+bool
+cdhring_service_want_space(cdhring_service *ring) {
+    // A failed ring reports space, so that the caller goes on to fail in the push.
+    if (ring->faulted) {
+        return true;
+    }
+    CDHRING_GUARD(ring, true);
+    cdhring_header *header = ring->layout.header;
+    atomic_store_explicit(&header->service_wants_space, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t tail = atomic_load_explicit(&header->reply_tail, memory_order_acquire);
+    CDHRING_UNGUARD();
+    return ring->reply_head - tail < ring->slots;
+}
+
+bool
+cdhring_service_want_requests(cdhring_service *ring) {
+    if (ring->faulted) {
+        return true;
+    }
+    CDHRING_GUARD(ring, true);
+    cdhring_header *header = ring->layout.header;
+    atomic_store_explicit(&header->service_wants_requests, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t head = atomic_load_explicit(&header->request_head, memory_order_acquire);
+    CDHRING_UNGUARD();
+    return head != ring->request_tail;
+}
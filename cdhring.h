@@ -0,0 +1,126 @@
+
+#ifndef cdhring_h
+#define cdhring_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cdhashd.h"
+
+/*
+ * A shared-memory transport for high-volume clients of the cdhash service. The client maps a
+ * region holding a request ring, a reply ring and a path arena, and hands it to the service
+ * over its cdhashd connection with CDHASHD_OP_ATTACH_RING, together with three wakeup fds
+ * (eventfd on Linux, a pipe elsewhere): one the client signals when it queues requests, one it
+ * signals when it frees reply slots, and one the service signals when it delivers replies.
+ * The two service wakeups are separate so that the service's reader can stop draining
+ * requests while the client is over its quota without holding up its writer. Requests carry
+ * the offset of their path in the arena; replies are fixed-size cdhashd_reply records. A side
+ * only makes a wakeup system call when the other side has said it is about to sleep, so
+ * under load neither side makes any.
+ *
+ * Once a ring is attached, all replies on that connection, including replies to requests
+ * sent over the socket, are delivered through the reply ring.
+ */
+typedef struct cdhring_client cdhring_client;
+
+/*
+ * cdhring_connect
+ *
+ * Description:
+ *     Create a ring and attach it to a connection to the cdhash service.
+ *
+ * Parameters:
+ *     socket_fd           A connected cdhashd socket.
+ *     slots               The number of request and reply slots. Must be a power of two.
+ *     arena_size          The size of the path arena.
+ */
+cdhring_client *cdhring_connect(int socket_fd, uint32_t slots, uint32_t arena_size);
+
+/*
+ * cdhring_submit
+ *
+ * Description:
+ *     Queue a request. Returns false if the request ring or the arena is full; collect some
+ *     replies with cdhring_poll() and try again.
+ */
+bool cdhring_submit(cdhring_client *ring, uint32_t tag, const char *path);
+
+/*
+ * cdhring_poll
+ *
+ * Description:
+ *     Collect up to count replies. If wait is set and no reply is ready, sleep until one is.
+ *     Returns the number of replies collected.
+ */
+size_t cdhring_poll(cdhring_client *ring, cdhashd_reply *replies, size_t count, bool wait);
+
+void cdhring_close(cdhring_client *ring);
+
+/*
+ * The service half. cdhashd uses these to drain requests from and deliver replies to an
+ * attached ring; everything read from the shared region is validated, since the client can
+ * change it at any time. On Linux, cdhring_service_attach() refuses a region that isn't
+ * sealed against shrinking; elsewhere a region the client shrinks fails the ring instead of
+ * raising SIGBUS in the service.
+ */
+typedef struct cdhring_service cdhring_service;
+
+cdhring_service *cdhring_service_attach(int shm_fd, int request_fd, int space_fd,
+        int wake_write_fd);
+
+void cdhring_service_detach(cdhring_service *ring);
+
+// The fd that becomes readable when the client queues requests the service asked for.
+int cdhring_service_request_fd(cdhring_service *ring);
+
+/*
+ * cdhring_service_wait_space
+ *
+ * Description:
+ *     Sleep until the client frees reply slots the service asked for with
+ *     cdhring_service_want_space(), or for at most timeout_ms.
+ */
+void cdhring_service_wait_space(cdhring_service *ring, int timeout_ms);
+
+/*
+ * cdhring_service_drain
+ *
+ * Description:
+ *     Consume every queued request, calling handle for each. handle may block, and while it
+ *     does the requests behind it stay in the ring; that is how the service holds back a
+ *     client that is over its quota. Returns false if the client corrupted the ring.
+ */
+bool cdhring_service_drain(cdhring_service *ring,
+        void (*handle)(void *context, uint32_t tag, const char *path), void *context);
+
+/*
+ * cdhring_service_push
+ *
+ * Description:
+ *     Deliver as many replies as fit. Returns the number delivered, or (size_t)-1 if the
+ *     client corrupted the ring.
+ */
+size_t cdhring_service_push(cdhring_service *ring, const cdhashd_reply *replies, size_t count);
+
+/*
+ * cdhring_service_want_space
+ *
+ * Description:
+ *     Ask the client to wake the service when it frees reply slots. Returns true if there is
+ *     already space, in which case the caller should not sleep; otherwise the caller sleeps
+ *     in cdhring_service_wait_space().
+ */
+bool cdhring_service_want_space(cdhring_service *ring);
+
+/*
+ * cdhring_service_want_requests
+ *
+ * Description:
+ *     Ask the client to wake the service when it queues requests. Returns true if requests
+ *     are already queued, in which case the caller should not sleep.
+ */
+bool cdhring_service_want_requests(cdhring_service *ring);
+
+#endif /* cdhring_h */
@@ -0,0 +1,214 @@
+
+/*
+ * Ring transport benchmark
+ * ------------------------
+ *
+ *  Runs cdhashd in-process and has one client send the same requests first over the socket,
+ *  with a window of requests pipelined, and then through a shared-memory ring, and reports the
+ *  request rate of each. With the default single file every request after the first is a
+ *  cache hit, so the numbers measure the transport rather than the hashing.
+ *
+ *  Build it with `make cdhring_bench` and run it against one or more signed Mach-O files:
+ *
+ *      cdhring_bench [-w workers] [-n requests] [-d socket_window] [-s ring_slots] file...
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdhashd.h"
+#include "cdhring.h"
+
+// The socket window must fit in this; see cdhashd_bench.c.
+#define BENCH_MAX_QUEUED 1024
+
+typedef struct bench_options {
+    unsigned workers;
+    unsigned requests;
+    unsigned socket_window;
+    unsigned ring_slots;
+    char *const *files;
+    unsigned file_count;
+} bench_options;
+
+static uint64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+bench_classify(uid_t uid, pid_t pid, cdh_class *class, unsigned *weight,
+        unsigned *max_inflight, unsigned *max_queued) {
+    (void)uid; (void)pid;
+    *class = CDH_CLASS_INTERACTIVE;
+    *weight = 1;
+    *max_inflight = 4;
+    *max_queued = BENCH_MAX_QUEUED;
+}
+
+static int
+bench_connect(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+bench_transfer(int fd, void *buf, size_t length, bool send) {
+    uint8_t *p = buf;
+    while (length > 0) {
+        ssize_t n = send ? write(fd, p, length) : read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Returns the request rate, or 0 on failure.
+static double
+bench_socket(const bench_options *options, const char *socket_path, uint64_t *failed) {
+    int fd = bench_connect(socket_path);
+    if (fd < 0) {
+        return 0;
+    }
+    uint64_t start = bench_now_ns();
+    unsigned sent = 0, received = 0;
+    while (received < options->requests) {
+        while (sent < options->requests && sent - received < options->socket_window) {
+            const char *path = options->files[sent % options->file_count];
+            cdhashd_request_header header = {
+                .op = CDHASHD_OP_HASH, .tag = sent, .length = (uint32_t)strlen(path),
+            };
+            if (!bench_transfer(fd, &header, sizeof(header), true)
+                    || !bench_transfer(fd, (void *)path, header.length, true)) {
+                close(fd);
+                return 0;
+            }
+            sent++;
+        }
+        cdhashd_reply reply;
+        if (!bench_transfer(fd, &reply, sizeof(reply), false)) {
+            close(fd);
+            return 0;
+        }
+        if (reply.status != CDHASHD_STATUS_OK) {
+            (*failed)++;
+        }
+        received++;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    close(fd);
+    return options->requests * 1e9 / elapsed;
+}
+
+// Returns the request rate, or 0 on failure.
+static double
+bench_ring(const bench_options *options, const char *socket_path, uint64_t *failed) {
+    int fd = bench_connect(socket_path);
+    cdhring_client *ring = (fd >= 0 ? cdhring_connect(fd, options->ring_slots, 1 << 20) : NULL);
+    if (ring == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    uint64_t start = bench_now_ns();
+    unsigned sent = 0, received = 0;
+    cdhashd_reply replies[256];
+    while (received < options->requests) {
+        while (sent < options->requests
+                && cdhring_submit(ring, sent, options->files[sent % options->file_count])) {
+            sent++;
+        }
+        size_t n = cdhring_poll(ring, replies, 256, true);
+        for (size_t i = 0; i < n; i++) {
+            if (replies[i].status != CDHASHD_STATUS_OK) {
+                (*failed)++;
+            }
+        }
+        received += n;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    cdhring_close(ring);
+    close(fd);
+    return options->requests * 1e9 / elapsed;
+}
+
+static void
+bench_usage(void) {
+    fprintf(stderr, "usage: cdhring_bench [-w workers] [-n requests] [-d socket_window] "
+            "[-s ring_slots] file...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv) {
+    bench_options options = {
+        .workers = 2,
+        .requests = 300000,
+        .socket_window = 256,
+        .ring_slots = 1024,
+    };
+    int ch;
+    while ((ch = getopt(argc, argv, "w:n:d:s:")) != -1) {
+        unsigned value = (unsigned)strtoul(optarg, NULL, 0);
+        switch (ch) {
+            case 'w': options.workers = value; break;
+            case 'n': options.requests = value; break;
+            case 'd': options.socket_window = value; break;
+            case 's': options.ring_slots = value; break;
+            default: bench_usage();
+        }
+    }
+    if (optind == argc || options.workers == 0 || options.requests == 0
+            || options.socket_window == 0 || options.socket_window > BENCH_MAX_QUEUED
+            || options.ring_slots == 0 || (options.ring_slots & (options.ring_slots - 1)) != 0) {
+        bench_usage();
+    }
+    options.files = argv + optind;
+    options.file_count = (unsigned)(argc - optind);
+
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/cdhring_bench.%d", (int)getpid());
+    cdhashd_config config = {
+        .socket_path = socket_path,
+        .workers = options.workers,
+        .cache_entries = 4096,
+        .classify = bench_classify,
+    };
+    cdhashd *service = cdhashd_start(&config);
+    if (service == NULL) {
+        fprintf(stderr, "cdhring_bench: can't start the service on %s\n", socket_path);
+        return 1;
+    }
+    uint64_t socket_failed = 0, ring_failed = 0;
+    double socket_rate = bench_socket(&options, socket_path, &socket_failed);
+    double ring_rate = bench_ring(&options, socket_path, &ring_failed);
+    printf("%u requests, %u workers\n", options.requests, options.workers);
+    printf("  socket (window %u): %.0f requests/s, %llu failed\n", options.socket_window,
+            socket_rate, (unsigned long long)socket_failed);
+    printf("  ring (%u slots):    %.0f requests/s, %llu failed\n", options.ring_slots,
+            ring_rate, (unsigned long long)ring_failed);
+    cdhashd_stop(service);
+    return socket_rate > 0 && ring_rate > 0 ? 0 : 1;
+}
@@ -0,0 +1,374 @@
+
+/*
+ * Request scheduling
+ * ------------------
+ *
+ *  Start-time fair queuing: a request is tagged with start = max(V, finish of the client's
+ *  previous request) and finish = start + COST / weight, where V is the start tag of the last
+ *  request dispatched in its class. The eligible request with the smallest start tag goes
+ *  next. A client that has been idle rejoins at V rather than with credit for the time it was
+ *  away, so a bulk client that has had the service to itself doesn't delay a newcomer.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cdhsched.h"
+
+// The virtual cost of one request at weight 1.
+#define CDH_REQUEST_COST (1ull << 20)
+
+typedef struct cdh_request {
+    struct cdh_request *next;
+    void *job;
+    uint64_t start_tag;
+    uint64_t enqueue_ns;
+} cdh_request;
+
+struct cdh_client {
+    struct cdh_client *next;
+    uid_t uid;
+    pid_t pid;
+    cdh_class class;
+    unsigned weight;
+    unsigned max_inflight;
+    unsigned max_queued;
+    bool released;
+    bool waiting_for_room;          // its submitter is blocked on max_queued
+    cdh_request *head;
+    cdh_request *tail;
+    uint64_t last_finish_tag;
+    uint64_t queued;
+    uint64_t inflight;
+    uint64_t dispatched;
+    uint64_t wait_ns_total;
+    uint64_t wait_ns_max;
+};
+
+struct cdh_sched {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;            // a request left a client's queue
+    void (*free_job)(void *job);
+    cdh_client *clients;
+    uint64_t virtual_time[CDH_CLASS_COUNT];
+    bool shutdown;
+};
+
+static uint64_t
+cdh_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Tag a request as it joins its client's queue.
+static void
+cdh_request_tag(cdh_sched *sched, cdh_client *client, cdh_request *request) {
+    uint64_t start = sched->virtual_time[client->class];
+    if (client->last_finish_tag > start) {
+        start = client->last_finish_tag;
+    }
+    request->start_tag = start;
+    client->last_finish_tag = start + CDH_REQUEST_COST / client->weight;
+}
+
+// Find the client whose request should be dispatched next. Must be called with the lock held.
+static cdh_client *
+cdh_sched_pick(cdh_sched *sched) {
+    for (int class = 0; class < CDH_CLASS_COUNT; class++) {
+        cdh_client *best = NULL;
+        for (cdh_client *c = sched->clients; c != NULL; c = c->next) {
+            if (c->class != (cdh_class)class || c->head == NULL
+                    || c->inflight >= c->max_inflight) {
+                continue;
+            }
+            if (best == NULL || c->head->start_tag < best->head->start_tag) {
+                best = c;
+            }
+        }
+        if (best != NULL) {
+            return best;
+        }
+    }
+    return NULL;
+}
+
+// Unlink and free a released client once nothing refers to it. Must be called with the lock
+// held.
+static void
+cdh_client_reap(cdh_sched *sched, cdh_client *client) {
+    if (!client->released || client->inflight != 0) {
+        return;
+    }
+    for (cdh_client **p = &sched->clients; *p != NULL; p = &(*p)->next) {
+        if (*p == client) {
+            *p = client->next;
+            break;
+        }
+    }
+    free(client);
+}
+
+cdh_sched *
+cdh_sched_create(void (*free_job)(void *job)) {
+    cdh_sched *sched = calloc(1, sizeof(*sched));
+    if (sched == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->ready, NULL);
+    pthread_cond_init(&sched->room, NULL);
+    sched->free_job = free_job;
+    return sched;
+}
+
+void
+cdh_sched_destroy(cdh_sched *sched) {
+    if (sched == NULL) {
+        return;
+    }
+    while (sched->clients != NULL) {
+        cdh_client *client = sched->clients;
+        sched->clients = client->next;
+        while (client->head != NULL) {
+            cdh_request *request = client->head;
+            client->head = request->next;
+            if (sched->free_job != NULL) {
+                sched->free_job(request->job);
+            }
+            free(request);
+        }
+        free(client);
+    }
+    pthread_cond_destroy(&sched->room);
+    pthread_cond_destroy(&sched->ready);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+cdh_client *
+cdh_sched_client_create(cdh_sched *sched, uid_t uid, pid_t pid, cdh_class class,
+        unsigned weight, unsigned max_inflight, unsigned max_queued) {
+    if (class >= CDH_CLASS_COUNT || weight == 0 || max_inflight == 0 || max_queued == 0) {
+        return NULL;
+    }
+    cdh_client *client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->uid = uid;
+    client->pid = pid;
+    client->class = class;
+    client->weight = weight;
+    client->max_inflight = max_inflight;
+    client->max_queued = max_queued;
+    pthread_mutex_lock(&sched->lock);
+    client->next = sched->clients;
+    sched->clients = client;
+    pthread_mutex_unlock(&sched->lock);
+    return client;
+}
+
+void
+cdh_sched_client_set_class(cdh_sched *sched, cdh_client *client, cdh_class class) {
+    if (class >= CDH_CLASS_COUNT) {
+        return;
+    }
+    pthread_mutex_lock(&sched->lock);
+    if (client->class != class) {
+        // Re-tag the queued requests against the new class's virtual time.
+        client->class = class;
+        client->last_finish_tag = 0;
+        for (cdh_request *request = client->head; request != NULL; request = request->next) {
+            cdh_request_tag(sched, client, request);
+        }
+        pthread_cond_broadcast(&sched->ready);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void
+cdh_sched_client_release(cdh_sched *sched, cdh_client *client) {
+    pthread_mutex_lock(&sched->lock);
+    cdh_request *request = client->head;
+    client->head = client->tail = NULL;
+    client->queued = 0;
+    client->released = true;
+    pthread_cond_broadcast(&sched->room);
+    cdh_client_reap(sched, client);
+    pthread_mutex_unlock(&sched->lock);
+    while (request != NULL) {
+        cdh_request *next = request->next;
+        if (sched->free_job != NULL) {
+            sched->free_job(request->job);
+        }
+        free(request);
+        request = next;
+    }
+}
+
+bool
+cdh_sched_submit(cdh_sched *sched, cdh_client *client, void *job) {
+    cdh_request *request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        return false;
+    }
+    request->job = job;
+    pthread_mutex_lock(&sched->lock);
+    while (client->queued >= client->max_queued && !client->released && !sched->shutdown) {
+        client->waiting_for_room = true;
+        pthread_cond_wait(&sched->room, &sched->lock);
+    }
+    if (client->released || sched->shutdown) {
+        pthread_mutex_unlock(&sched->lock);
+        free(request);
+        return false;
+    }
+    request->enqueue_ns = cdh_now_ns();
+    cdh_request_tag(sched, client, request);
+    if (client->tail != NULL) {
+        client->tail->next = request;
+    } else {
+        client->head = request;
+    }
+    client->tail = request;
+    client->queued++;
+    pthread_cond_signal(&sched->ready);
+    pthread_mutex_unlock(&sched->lock);
+    return true;
+}
+
+void *
+cdh_sched_next(cdh_sched *sched, cdh_client **client_out) {
+    pthread_mutex_lock(&sched->lock);
+    cdh_client *client;
+    while ((client = cdh_sched_pick(sched)) == NULL && !sched->shutdown) {
+        pthread_cond_wait(&sched->ready, &sched->lock);
+    }
+    if (sched->shutdown) {
+        pthread_mutex_unlock(&sched->lock);
+        return NULL;
+    }
+    cdh_request *request = client->head;
+    client->head = request->next;
+    if (client->head == NULL) {
+        client->tail = NULL;
+    }
+    client->queued--;
+    // Let a blocked submitter refill half the queue at a time rather than wake it for every
+    // request.
+    if (client->waiting_for_room && client->queued <= client->max_queued / 2) {
+        client->waiting_for_room = false;
+        pthread_cond_broadcast(&sched->room);
+    }
+    client->inflight++;
+    client->dispatched++;
+    sched->virtual_time[client->class] = request->start_tag;
+    uint64_t wait_ns = cdh_now_ns() - request->enqueue_ns;
+    client->wait_ns_total += wait_ns;
+    if (wait_ns > client->wait_ns_max) {
+        client->wait_ns_max = wait_ns;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    void *job = request->job;
+    free(request);
+    *client_out = client;
+    return job;
+}
+
+void
+cdh_sched_complete(cdh_sched *sched, cdh_client *client) {
+    pthread_mutex_lock(&sched->lock);
+    client->inflight--;
+    cdh_client_reap(sched, client);
+    // A slot under this client's concurrency limit may have opened up.
+    pthread_cond_broadcast(&sched->ready);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void
+cdh_sched_shutdown(cdh_sched *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->shutdown = true;
+    pthread_cond_broadcast(&sched->ready);
+    pthread_cond_broadcast(&sched->room);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+size_t
+cdh_sched_get_metrics(cdh_sched *sched, cdh_client_metrics *metrics, size_t count) {
+    pthread_mutex_lock(&sched->lock);
+    size_t n = 0;
+    for (cdh_client *c = sched->clients; c != NULL; c = c->next, n++) {
+        if (n >= count) {
+            continue;
+        }
+        cdh_client_metrics *m = &metrics[n];
+        m->uid = c->uid;
+        m->pid = c->pid;
+        m->class = c->class;
+        m->weight = c->weight;
+        m->max_inflight = c->max_inflight;
+        m->max_queued = c->max_queued;
+        m->queued = c->queued;
+        m->inflight = c->inflight;
+        m->dispatched = c->dispatched;
+        m->wait_ns_total = c->wait_ns_total;
+        m->wait_ns_max = c->wait_ns_max;
+        // Count what is queued ahead of this client's oldest request: everything in a higher
+        // class, and everything in its class with an earlier start tag.
+        m->queue_position = 0;
+        if (c->head == NULL) {
+            continue;
+        }
+        for (cdh_client *o = sched->clients; o != NULL; o = o->next) {
+            if (o == c || o->class > c->class) {
+                continue;
+            }
+            for (cdh_request *r = o->head; r != NULL; r = r->next) {
+                if (o->class < c->class || r->start_tag < c->head->start_tag) {
+                    m->queue_position++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return n;
+}
+
+void
+cdh_sched_report(cdh_sched *sched, FILE *out) {
+    static const char *class_names[CDH_CLASS_COUNT] = {
+        [CDH_CLASS_INTERACTIVE] = "interactive",
+        [CDH_CLASS_NORMAL]      = "normal",
+        [CDH_CLASS_BULK]        = "bulk",
+    };
+    size_t count = cdh_sched_get_metrics(sched, NULL, 0);
+    cdh_client_metrics *metrics = calloc(count ? count : 1, sizeof(*metrics));
+    if (metrics == NULL) {
+        return;
+    }
+    // Clients may have connected since the first call; only the ones that fit are shown.
+    size_t capacity = count;
+    count = cdh_sched_get_metrics(sched, metrics, capacity);
+    if (count > capacity) {
+        count = capacity;
+    }
+    fprintf(out, "%8s %8s %-12s %6s %8s %8s %10s %8s %12s %12s\n", "pid", "uid", "class",
+            "weight", "queued", "inflight", "dispatched", "position", "avg_wait_us",
+            "max_wait_us");
+    for (size_t i = 0; i < count; i++) {
+        const cdh_client_metrics *m = &metrics[i];
+        fprintf(out, "%8d %8u %-12s %6u %8llu %8llu %10llu %8llu %12.1f %12.1f\n",
+                (int)m->pid, (unsigned)m->uid, class_names[m->class], m->weight,
+                (unsigned long long)m->queued, (unsigned long long)m->inflight,
+                (unsigned long long)m->dispatched, (unsigned long long)m->queue_position,
+                m->dispatched ? m->wait_ns_total / 1e3 / m->dispatched : 0.0,
+                m->wait_ns_max / 1e3);
+    }
+    free(metrics);
+}
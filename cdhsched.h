@@ -0,0 +1,132 @@
+
+#ifndef cdhsched_h
+#define cdhsched_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * The request scheduler of the local cdhash service. Each connected client has its own FIFO
+ * queue. Classes are served in strict priority order; within a class, clients share the
+ * workers by start-time fair queuing in proportion to their weights, and no client has more
+ * than its concurrency limit of requests in service at once, nor more than its queue limit
+ * waiting for service.
+ */
+typedef enum cdh_class {
+    CDH_CLASS_INTERACTIVE,             // e.g. the amfid handler, waiting on an exec
+    CDH_CLASS_NORMAL,                  // e.g. installers
+    CDH_CLASS_BULK,                    // e.g. scanners
+    CDH_CLASS_COUNT,
+} cdh_class;
+
+typedef struct cdh_sched cdh_sched;
+typedef struct cdh_client cdh_client;
+
+/*
+ * cdh_client_metrics
+ *
+ * Description:
+ *     A snapshot of a client's state. queue_position is the number of queued requests that
+ *     will be dispatched before the client's oldest queued request.
+ */
+typedef struct cdh_client_metrics {
+    uid_t uid;
+    pid_t pid;
+    cdh_class class;
+    unsigned weight;
+    unsigned max_inflight;
+    unsigned max_queued;
+    uint64_t queued;
+    uint64_t inflight;
+    uint64_t dispatched;
+    uint64_t queue_position;
+    uint64_t wait_ns_total;
+    uint64_t wait_ns_max;
+} cdh_client_metrics;
+
+/*
+ * cdh_sched_create
+ *
+ * Description:
+ *     Create a scheduler. free_job is called on requests that are dropped because their
+ *     client went away before they were dispatched; it may be NULL.
+ */
+cdh_sched *cdh_sched_create(void (*free_job)(void *job));
+
+/*
+ * cdh_sched_destroy
+ *
+ * Description:
+ *     Destroy a scheduler. All workers must have returned from cdh_sched_next().
+ */
+void cdh_sched_destroy(cdh_sched *sched);
+
+/*
+ * cdh_sched_client_create
+ *
+ * Description:
+ *     Register a client, identified by the credentials of its connection. The client may
+ *     have up to max_inflight requests in service and max_queued waiting.
+ */
+cdh_client *cdh_sched_client_create(cdh_sched *sched, uid_t uid, pid_t pid, cdh_class class,
+        unsigned weight, unsigned max_inflight, unsigned max_queued);
+
+/*
+ * cdh_sched_client_set_class
+ *
+ * Description:
+ *     Move a client to another priority class. Its queued requests move with it.
+ */
+void cdh_sched_client_set_class(cdh_sched *sched, cdh_client *client, cdh_class class);
+
+/*
+ * cdh_sched_client_release
+ *
+ * Description:
+ *     Unregister a client. Its queued requests are dropped; the client is freed once its
+ *     in-flight requests complete.
+ */
+void cdh_sched_client_release(cdh_sched *sched, cdh_client *client);
+
+/*
+ * cdh_sched_submit
+ *
+ * Description:
+ *     Queue a request. While the client already has max_queued requests waiting, this blocks
+ *     until one is dispatched, so a caller reading requests on the client's behalf stops
+ *     reading. Returns false if the client was released or the scheduler shut down.
+ */
+bool cdh_sched_submit(cdh_sched *sched, cdh_client *client, void *job);
+
+/*
+ * cdh_sched_next
+ *
+ * Description:
+ *     Wait for the next request to serve. Returns NULL once the scheduler is shut down.
+ *     Every request returned must be passed to cdh_sched_complete() when done.
+ */
+void *cdh_sched_next(cdh_sched *sched, cdh_client **client);
+
+void cdh_sched_complete(cdh_sched *sched, cdh_client *client);
+
+/*
+ * cdh_sched_shutdown
+ *
+ * Description:
+ *     Wake up all workers waiting in cdh_sched_next() and make it return NULL.
+ */
+void cdh_sched_shutdown(cdh_sched *sched);
+
+/*
+ * cdh_sched_get_metrics
+ *
+ * Description:
+ *     Fill in the metrics of up to count clients. Returns the number of clients.
+ */
+size_t cdh_sched_get_metrics(cdh_sched *sched, cdh_client_metrics *metrics, size_t count);
+
+void cdh_sched_report(cdh_sched *sched, FILE *out);
+
+#endif /* cdhsched_h */
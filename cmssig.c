@@ -0,0 +1,622 @@
+
+/*
+ * CMS signature verification
+ * --------------------------
+ *
+ *  The CSSLOT_SIGNATURESLOT blob wraps a DER-encoded CMS SignedData (RFC 5652) with detached
+ *  content. The signed content is the primary CodeDirectory; its digest is carried in the
+ *  messageDigest signed attribute, and Apple adds two hash agility attributes that bind every
+ *  code directory: a plist of their cdhashes, and a set of their full digests, each with its
+ *  algorithm. Only the parts of SignedData needed to check those attributes and the signature
+ *  over them are parsed.
+ *
+ */
+
+#include <CommonCrypto/CommonCrypto.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <Security/Security.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cmssig.h"
+
+// ---- DER ------------------------------------------------------------------------------------
+
+enum {
+    DER_INTEGER      = 0x02,
+    DER_OCTET_STRING = 0x04,
+    DER_OID          = 0x06,
+    DER_SEQUENCE     = 0x30,
+    DER_SET          = 0x31,
+    DER_CONTEXT_0    = 0xa0,
+    DER_CONTEXT_1    = 0xa1,
+};
+
+typedef struct der {
+    const uint8_t *p;
+    const uint8_t *end;
+} der;
+
+static const uint8_t oid_signed_data[]    = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02 };
+static const uint8_t oid_message_digest[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x04 };
+static const uint8_t oid_apple_cdhashes[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x63, 0x64, 0x09, 0x01 };
+static const uint8_t oid_apple_digests[]  = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x63, 0x64, 0x09, 0x02 };
+static const uint8_t oid_sha1[]           = { 0x2b, 0x0e, 0x03, 0x02, 0x1a };
+static const uint8_t oid_sha256[]         = { 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01 };
+static const uint8_t oid_sha384[]         = { 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02 };
+
+// Read the next element. On return, content spans its value and *element (if not NULL) spans
+// the whole element including the tag and length.
+static bool
+der_next(der *d, uint8_t *tag, der *content, der *element) {
+    const uint8_t *start = d->p;
+    if (d->end - d->p < 2) {
+        return false;
+    }
+    uint8_t t = *d->p++;
+    // Multi-byte tags don't appear in the structures we parse.
+    if ((t & 0x1f) == 0x1f) {
+        return false;
+    }
+    size_t length = *d->p++;
+    if (length & 0x80) {
+        size_t n = length & 0x7f;
+        if (n == 0 || n > 4 || (size_t)(d->end - d->p) < n) {
+            return false;
+        }
+        length = 0;
+        for (size_t i = 0; i < n; i++) {
+            length = (length << 8) | *d->p++;
+        }
+    }
+    if ((size_t)(d->end - d->p) < length) {
+        return false;
+    }
+    content->p = d->p;
+    content->end = d->p + length;
+    d->p += length;
+    if (element != NULL) {
+        element->p = start;
+        element->end = d->p;
+    }
+    *tag = t;
+    return true;
+}
+
+// Read the next element, which must have the given tag.
+static bool
+der_expect(der *d, uint8_t tag, der *content, der *element) {
+    uint8_t t;
+    return der_next(d, &t, content, element) && t == tag;
+}
+
+// Check whether the next element has the given tag without consuming it.
+static bool
+der_peek(const der *d, uint8_t tag) {
+    return d->p < d->end && *d->p == tag;
+}
+
+static bool
+der_equals(const der *d, const void *data, size_t length) {
+    return (size_t)(d->end - d->p) == length && memcmp(d->p, data, length) == 0;
+}
+
+// Strip the leading zero bytes of an INTEGER's content.
+static void
+der_integer_strip(der *d) {
+    while (d->end - d->p > 1 && d->p[0] == 0) {
+        d->p++;
+    }
+}
+
+// ---- SignedData -----------------------------------------------------------------------------
+
+typedef struct cms_signer {
+    der certificates;          // the content of the certificates field
+    der serial;                // the signer's serial number
+    der digest_algorithm;      // the OID of the signer's digest algorithm
+    der signed_attributes;     // the whole [0] signedAttrs element
+    der signature;
+} cms_signer;
+
+// Parse the parts of a SignedData needed to check its first signer.
+static bool
+cms_parse(const uint8_t *data, size_t size, cms_signer *signer) {
+    der d = { data, data + size };
+    der content_info, signed_data_wrapper, signed_data, field;
+    // ContentInfo ::= SEQUENCE { contentType, [0] EXPLICIT content }
+    if (!der_expect(&d, DER_SEQUENCE, &content_info, NULL)
+            || !der_expect(&content_info, DER_OID, &field, NULL)
+            || !der_equals(&field, oid_signed_data, sizeof(oid_signed_data))
+            || !der_expect(&content_info, DER_CONTEXT_0, &signed_data_wrapper, NULL)
+            || !der_expect(&signed_data_wrapper, DER_SEQUENCE, &signed_data, NULL)) {
+        return false;
+    }
+    // SignedData ::= SEQUENCE { version, digestAlgorithms, encapContentInfo,
+    //     [0] certificates OPTIONAL, [1] crls OPTIONAL, signerInfos }
+    if (!der_expect(&signed_data, DER_INTEGER, &field, NULL)
+            || !der_expect(&signed_data, DER_SET, &field, NULL)
+            || !der_expect(&signed_data, DER_SEQUENCE, &field, NULL)) {
+        return false;
+    }
+    memset(signer, 0, sizeof(*signer));
+    if (der_peek(&signed_data, DER_CONTEXT_0)
+            && !der_expect(&signed_data, DER_CONTEXT_0, &signer->certificates, NULL)) {
+        return false;
+    }
+    if (der_peek(&signed_data, DER_CONTEXT_1)
+            && !der_expect(&signed_data, DER_CONTEXT_1, &field, NULL)) {
+        return false;
+    }
+    der signer_infos, signer_info, sid, algorithm;
+    if (!der_expect(&signed_data, DER_SET, &signer_infos, NULL)
+            || !der_expect(&signer_infos, DER_SEQUENCE, &signer_info, NULL)) {
+        return false;
+    }
+    // SignerInfo ::= SEQUENCE { version, sid, digestAlgorithm, [0] signedAttrs,
+    //     signatureAlgorithm, signature, ... }
+    // Only the IssuerAndSerialNumber form of sid is supported, which is what codesign emits.
+    if (!der_expect(&signer_info, DER_INTEGER, &field, NULL)
+            || !der_expect(&signer_info, DER_SEQUENCE, &sid, NULL)
+            || !der_expect(&sid, DER_SEQUENCE, &field, NULL)
+            || !der_expect(&sid, DER_INTEGER, &signer->serial, NULL)
+            || !der_expect(&signer_info, DER_SEQUENCE, &algorithm, NULL)
+            || !der_expect(&algorithm, DER_OID, &signer->digest_algorithm, NULL)
+            || !der_expect(&signer_info, DER_CONTEXT_0, &field, &signer->signed_attributes)
+            || !der_expect(&signer_info, DER_SEQUENCE, &field, NULL)
+            || !der_expect(&signer_info, DER_OCTET_STRING, &signer->signature, NULL)) {
+        return false;
+    }
+    der_integer_strip(&signer->serial);
+    return signer->certificates.p != NULL;
+}
+
+// Find the set of values of a signed attribute.
+static bool
+cms_find_attribute_values(const cms_signer *signer, const uint8_t *oid, size_t oid_length,
+        der *values) {
+    uint8_t t;
+    der attributes, attribute, type;
+    der d = signer->signed_attributes;
+    if (!der_next(&d, &t, &attributes, NULL)) {
+        return false;
+    }
+    while (attributes.p < attributes.end) {
+        if (!der_expect(&attributes, DER_SEQUENCE, &attribute, NULL)
+                || !der_expect(&attribute, DER_OID, &type, NULL)
+                || !der_expect(&attribute, DER_SET, values, NULL)) {
+            return false;
+        }
+        if (der_equals(&type, oid, oid_length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Find the value of a signed attribute.
+static bool
+cms_find_attribute(const cms_signer *signer, const uint8_t *oid, size_t oid_length,
+        uint8_t tag, der *value) {
+    der values;
+    return cms_find_attribute_values(signer, oid, oid_length, &values)
+        && der_expect(&values, tag, value, NULL);
+}
+
+// Compute the full digest of a code directory with its own hash type, and get the OID of that
+// digest algorithm. SHA256_TRUNCATED code directories are listed under SHA-256.
+static bool
+cms_code_directory_digest(const cs_signature_blobs *blobs, unsigned i, uint8_t *digest,
+        size_t *digest_length, der *oid) {
+    const CS_CodeDirectory *cd = blobs->code_directories[i];
+    CC_LONG cd_length = (CC_LONG) blobs->code_directory_sizes[i];
+    switch (cd->hashType) {
+        case CS_HASHTYPE_SHA1:
+            CC_SHA1(cd, cd_length, digest);
+            *digest_length = CC_SHA1_DIGEST_LENGTH;
+            *oid = (der) { oid_sha1, oid_sha1 + sizeof(oid_sha1) };
+            return true;
+        case CS_HASHTYPE_SHA256:
+        case CS_HASHTYPE_SHA256_TRUNCATED:
+            CC_SHA256(cd, cd_length, digest);
+            *digest_length = CC_SHA256_DIGEST_LENGTH;
+            *oid = (der) { oid_sha256, oid_sha256 + sizeof(oid_sha256) };
+            return true;
+        case CS_HASHTYPE_SHA384:
+            CC_SHA384(cd, cd_length, digest);
+            *digest_length = CC_SHA384_DIGEST_LENGTH;
+            *oid = (der) { oid_sha384, oid_sha384 + sizeof(oid_sha384) };
+            return true;
+    }
+    return false;
+}
+
+// Check every code directory against the second hash agility attribute, a set of
+// SEQUENCE { digestAlgorithm, OCTET STRING } holding the full digest of each code directory.
+static bool
+cms_check_digests(const cs_signature_blobs *blobs, const der *values) {
+    for (unsigned i = 0; i < 1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX; i++) {
+        if (blobs->code_directories[i] == NULL) {
+            continue;
+        }
+        uint8_t digest[CC_SHA384_DIGEST_LENGTH];
+        size_t digest_length;
+        der oid;
+        if (!cms_code_directory_digest(blobs, i, digest, &digest_length, &oid)) {
+            return false;
+        }
+        bool found = false;
+        der d = *values;
+        while (!found && d.p < d.end) {
+            der entry, algorithm, value;
+            if (!der_expect(&d, DER_SEQUENCE, &entry, NULL)
+                    || !der_expect(&entry, DER_OID, &algorithm, NULL)
+                    || !der_expect(&entry, DER_OCTET_STRING, &value, NULL)) {
+                return false;
+            }
+            found = der_equals(&algorithm, oid.p, oid.end - oid.p)
+                && der_equals(&value, digest, digest_length);
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check every code directory against the first hash agility attribute, a plist whose
+// "cdhashes" array holds the cdhash of each code directory.
+static bool
+cms_check_cdhashes(const cs_signature_blobs *blobs, const der *plist_data) {
+    CFDataRef data = CFDataCreateWithBytesNoCopy(NULL, plist_data->p,
+            plist_data->end - plist_data->p, kCFAllocatorNull);
+    CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data,
+            kCFPropertyListImmutable, NULL, NULL);
+    CFRelease(data);
+    if (plist == NULL) {
+        return false;
+    }
+    bool ok = false;
+    CFArrayRef cdhashes = NULL;
+    if (CFGetTypeID(plist) == CFDictionaryGetTypeID()) {
+        cdhashes = CFDictionaryGetValue(plist, CFSTR("cdhashes"));
+    }
+    if (cdhashes != NULL && CFGetTypeID(cdhashes) == CFArrayGetTypeID()) {
+        ok = true;
+        CFIndex count = CFArrayGetCount(cdhashes);
+        for (unsigned i = 0; ok && i < 1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX; i++) {
+            if (blobs->code_directories[i] == NULL) {
+                continue;
+            }
+            bool found = false;
+            for (CFIndex j = 0; !found && j < count; j++) {
+                CFDataRef cdhash = CFArrayGetValueAtIndex(cdhashes, j);
+                found = (CFGetTypeID(cdhash) == CFDataGetTypeID()
+                        && CFDataGetLength(cdhash) >= CS_CDHASH_LEN
+                        && memcmp(CFDataGetBytePtr(cdhash), blobs->code_directory_cdhashes[i],
+                            CS_CDHASH_LEN) == 0);
+            }
+            ok = found;
+        }
+    }
+    CFRelease(plist);
+    return ok;
+}
+
+// Check that the signed attributes cover the code directories.
+static bool
+cms_check_attributes(const cms_signer *signer, const cs_signature_blobs *blobs) {
+    // The messageDigest is the digest of the primary code directory.
+    const CS_CodeDirectory *cd = blobs->code_directories[0];
+    CC_LONG cd_length = (CC_LONG) blobs->code_directory_sizes[0];
+    uint8_t digest[CC_SHA384_DIGEST_LENGTH];
+    size_t digest_length;
+    if (der_equals(&signer->digest_algorithm, oid_sha1, sizeof(oid_sha1))) {
+        CC_SHA1(cd, cd_length, digest);
+        digest_length = CC_SHA1_DIGEST_LENGTH;
+    } else if (der_equals(&signer->digest_algorithm, oid_sha256, sizeof(oid_sha256))) {
+        CC_SHA256(cd, cd_length, digest);
+        digest_length = CC_SHA256_DIGEST_LENGTH;
+    } else if (der_equals(&signer->digest_algorithm, oid_sha384, sizeof(oid_sha384))) {
+        CC_SHA384(cd, cd_length, digest);
+        digest_length = CC_SHA384_DIGEST_LENGTH;
+    } else {
+        return false;
+    }
+    der message_digest;
+    if (!cms_find_attribute(signer, oid_message_digest, sizeof(oid_message_digest),
+                DER_OCTET_STRING, &message_digest)
+            || !der_equals(&message_digest, digest, digest_length)) {
+        return false;
+    }
+    // messageDigest only binds the primary code directory. Every other code directory is
+    // bound through the hash agility attributes, and compute_cdhash() may pick any of them,
+    // so a signature with alternates must carry at least one of them, and every code
+    // directory, whatever its hash type, must be listed in each one present.
+    bool have_alternates = false;
+    for (unsigned i = 0; i < 1 + CSSLOT_ALTERNATE_CODEDIRECTORY_MAX; i++) {
+        if (blobs->code_directories[i] == NULL) {
+            continue;
+        }
+        if (!blobs->code_directory_hash_valid[i]) {
+            return false;
+        }
+        have_alternates |= (i != 0);
+    }
+    der plist_data, digests;
+    bool have_plist = cms_find_attribute(signer, oid_apple_cdhashes, sizeof(oid_apple_cdhashes),
+            DER_OCTET_STRING, &plist_data);
+    bool have_digests = cms_find_attribute_values(signer, oid_apple_digests,
+            sizeof(oid_apple_digests), &digests);
+    if (!have_plist && !have_digests) {
+        return !have_alternates;
+    }
+    return (!have_plist || cms_check_cdhashes(blobs, &plist_data))
+        && (!have_digests || cms_check_digests(blobs, &digests));
+}
+
+// ---- Chain cache ----------------------------------------------------------------------------
+
+typedef struct cms_chain_entry {
+    uint8_t fingerprint[CC_SHA256_DIGEST_LENGTH];
+    SecKeyRef key;
+    uint64_t expires_ns;
+} cms_chain_entry;
+
+struct cms_chain_cache {
+    pthread_mutex_t lock;
+    cms_chain_entry *entries;
+    unsigned capacity;
+    unsigned count;
+    unsigned next;             // the entry to replace when full
+    uint64_t ttl_ns;
+};
+
+static uint64_t
+cms_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+cms_chain_cache *
+cms_chain_cache_create(unsigned capacity, unsigned ttl_seconds) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    cms_chain_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->entries = calloc(capacity, sizeof(*cache->entries));
+    if (cache->entries == NULL) {
+        free(cache);
+        return NULL;
+    }
+    cache->capacity = capacity;
+    cache->ttl_ns = ttl_seconds * 1000000000ull;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void
+cms_chain_cache_destroy(cms_chain_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (unsigned i = 0; i < cache->count; i++) {
+        CFRelease(cache->entries[i].key);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache);
+}
+
+void
+cms_chain_cache_flush(cms_chain_cache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned i = 0; i < cache->count; i++) {
+        CFRelease(cache->entries[i].key);
+    }
+    cache->count = 0;
+    cache->next = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Look up the public key of an already validated signer certificate whose validation hasn't
+// expired. An expired entry is dropped, so the chain is evaluated again.
+static SecKeyRef
+cms_chain_cache_lookup(cms_chain_cache *cache, const uint8_t *fingerprint) {
+    SecKeyRef key = NULL;
+    uint64_t now = cms_now_ns();
+    pthread_mutex_lock(&cache->lock);
+    for (unsigned i = 0; i < cache->count; i++) {
+        cms_chain_entry *entry = &cache->entries[i];
+        if (memcmp(entry->fingerprint, fingerprint, CC_SHA256_DIGEST_LENGTH) != 0) {
+            continue;
+        }
+        if (now < entry->expires_ns) {
+            key = (SecKeyRef)CFRetain(entry->key);
+        } else {
+            // Move the last entry into the hole, keeping the entries dense.
+            CFRelease(entry->key);
+            *entry = cache->entries[--cache->count];
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return key;
+}
+
+static void
+cms_chain_cache_insert(cms_chain_cache *cache, const uint8_t *fingerprint, SecKeyRef key) {
+    pthread_mutex_lock(&cache->lock);
+    cms_chain_entry *entry;
+    if (cache->count < cache->capacity) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % cache->capacity;
+        CFRelease(entry->key);
+    }
+    memcpy(entry->fingerprint, fingerprint, CC_SHA256_DIGEST_LENGTH);
+    entry->key = (SecKeyRef)CFRetain(key);
+    entry->expires_ns = cms_now_ns() + cache->ttl_ns;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Find the signer's certificate in the certificates field.
+static bool
+cms_find_signer_certificate(const cms_signer *signer, der *certificate) {
+    der certificates = signer->certificates;
+    while (certificates.p < certificates.end) {
+        der cert, tbs, serial, content;
+        if (!der_expect(&certificates, DER_SEQUENCE, &content, &cert)
+                || !der_expect(&content, DER_SEQUENCE, &tbs, NULL)) {
+            return false;
+        }
+        // TBSCertificate ::= SEQUENCE { [0] version OPTIONAL, serialNumber, ... }
+        if (der_peek(&tbs, DER_CONTEXT_0) && !der_expect(&tbs, DER_CONTEXT_0, &serial, NULL)) {
+            return false;
+        }
+        if (!der_expect(&tbs, DER_INTEGER, &serial, NULL)) {
+            return false;
+        }
+        der_integer_strip(&serial);
+        if (der_equals(&serial, signer->serial.p, signer->serial.end - signer->serial.p)) {
+            *certificate = cert;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Append a DER certificate to an array of SecCertificateRefs.
+static bool
+cms_append_certificate(CFMutableArrayRef certificates, const der *cert) {
+    CFDataRef data = CFDataCreate(NULL, cert->p, cert->end - cert->p);
+    SecCertificateRef certificate = SecCertificateCreateWithData(NULL, data);
+    CFRelease(data);
+    if (certificate == NULL) {
+        return false;
+    }
+    CFArrayAppendValue(certificates, certificate);
+    CFRelease(certificate);
+    return true;
+}
+
+// Evaluate the trust of the signer's chain and return the signer's public key.
+static SecKeyRef
+cms_evaluate_chain(const cms_signer *signer, const der *signer_certificate) {
+    CFMutableArrayRef certificates = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    // The signer's certificate goes first; the rest are candidate intermediates.
+    bool ok = cms_append_certificate(certificates, signer_certificate);
+    der certs = signer->certificates;
+    while (ok && certs.p < certs.end) {
+        der cert, content;
+        ok = der_expect(&certs, DER_SEQUENCE, &content, &cert);
+        if (ok && cert.p != signer_certificate->p) {
+            ok = cms_append_certificate(certificates, &cert);
+        }
+    }
+    SecKeyRef key = NULL;
+    // The code signing policy requires the codeSigning extended key usage on the leaf, so a
+    // certificate issued for anything else (a TLS server, say) is not accepted as a signer.
+    SecPolicyRef policy = NULL;
+    if (ok) {
+        policy = SecPolicyCreateWithProperties(kSecPolicyAppleCodeSigning, NULL);
+    }
+    if (policy != NULL) {
+        SecTrustRef trust = NULL;
+        if (SecTrustCreateWithCertificates(certificates, policy, &trust) == errSecSuccess
+                && SecTrustEvaluateWithError(trust, NULL)) {
+            key = SecCertificateCopyKey(
+                    (SecCertificateRef)CFArrayGetValueAtIndex(certificates, 0));
+        }
+        if (trust != NULL) {
+            CFRelease(trust);
+        }
+        CFRelease(policy);
+    }
+    CFRelease(certificates);
+    return key;
+}
+
+// Check the signature over the signed attributes with the signer's public key.
+static bool
+cms_check_signature(const cms_signer *signer, SecKeyRef key) {
+    CFDictionaryRef attributes = SecKeyCopyAttributes(key);
+    if (attributes == NULL) {
+        return false;
+    }
+    bool rsa = CFEqual(CFDictionaryGetValue(attributes, kSecAttrKeyType), kSecAttrKeyTypeRSA);
+    CFRelease(attributes);
+    SecKeyAlgorithm algorithm;
+    if (der_equals(&signer->digest_algorithm, oid_sha1, sizeof(oid_sha1))) {
+        algorithm = rsa ? kSecKeyAlgorithmRSASignatureMessagePKCS1v15SHA1
+                        : kSecKeyAlgorithmECDSASignatureMessageX962SHA1;
+    } else if (der_equals(&signer->digest_algorithm, oid_sha256, sizeof(oid_sha256))) {
+        algorithm = rsa ? kSecKeyAlgorithmRSASignatureMessagePKCS1v15SHA256
+                        : kSecKeyAlgorithmECDSASignatureMessageX962SHA256;
+    } else {
+        algorithm = rsa ? kSecKeyAlgorithmRSASignatureMessagePKCS1v15SHA384
+                        : kSecKeyAlgorithmECDSASignatureMessageX962SHA384;
+    }
+    // The signature covers the DER encoding of the attributes as a SET, not as [0].
+    size_t attributes_length = signer->signed_attributes.end - signer->signed_attributes.p;
+    uint8_t *signed_bytes = malloc(attributes_length);
+    if (signed_bytes == NULL) {
+        return false;
+    }
+    memcpy(signed_bytes, signer->signed_attributes.p, attributes_length);
+    signed_bytes[0] = DER_SET;
+    CFDataRef message = CFDataCreateWithBytesNoCopy(NULL, signed_bytes, attributes_length,
+            kCFAllocatorMalloc);
+    CFDataRef signature = CFDataCreate(NULL, signer->signature.p,
+            signer->signature.end - signer->signature.p);
+    bool ok = SecKeyVerifySignature(key, algorithm, message, signature, NULL);
+    CFRelease(signature);
+    CFRelease(message);
+    return ok;
+}
+
+bool
+cms_verify_signature(const cs_signature_blobs *blobs, cms_chain_cache *cache) {
+    if (blobs->cms == NULL || blobs->code_directories[0] == NULL) {
+        return false;
+    }
+    cms_signer signer;
+    if (!cms_parse((const uint8_t *)blobs->cms->data, blobs->cms_size - sizeof(*blobs->cms),
+                &signer)) {
+        return false;
+    }
+    // The attributes are cheap to check, so reject mismatched signatures before any
+    // public-key work.
+    if (!cms_check_attributes(&signer, blobs)) {
+        return false;
+    }
+    der certificate;
+    if (!cms_find_signer_certificate(&signer, &certificate)) {
+        return false;
+    }
+    uint8_t fingerprint[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(certificate.p, (CC_LONG)(certificate.end - certificate.p), fingerprint);
+    SecKeyRef key = NULL;
+    if (cache != NULL) {
+        key = cms_chain_cache_lookup(cache, fingerprint);
+    }
+    bool cached = (key != NULL);
+    if (!cached) {
+        key = cms_evaluate_chain(&signer, &certificate);
+        if (key == NULL) {
+            return false;
+        }
+    }
+    bool ok = cms_check_signature(&signer, key);
+    // Only remember a chain once a signature made with it has checked out.
+    if (ok && !cached && cache != NULL) {
+        cms_chain_cache_insert(cache, fingerprint, key);
+    }
+    CFRelease(key);
+    return ok;
+}
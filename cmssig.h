@@ -0,0 +1,55 @@
+
+#ifndef cmssig_h
+#define cmssig_h
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cdhash.h"
+
+/*
+ * A cache of signer certificates whose chains have already been validated, keyed by the
+ * SHA-256 fingerprint of the signer certificate. A hit skips certificate parsing and trust
+ * evaluation, leaving only the signature check over the signed attributes. A validation is
+ * trusted for a limited time, after which the chain is evaluated again, so a revoked or
+ * expired certificate stops being accepted.
+ */
+typedef struct cms_chain_cache cms_chain_cache;
+
+/*
+ * cms_chain_cache_create
+ *
+ * Description:
+ *     Create a chain cache holding up to capacity signer certificates, each for ttl_seconds
+ *     after its chain was evaluated.
+ */
+cms_chain_cache *cms_chain_cache_create(unsigned capacity, unsigned ttl_seconds);
+
+/*
+ * cms_chain_cache_flush
+ *
+ * Description:
+ *     Forget every validated chain, for when the trust settings or the revocation state may
+ *     have changed.
+ */
+void cms_chain_cache_flush(cms_chain_cache *cache);
+
+void cms_chain_cache_destroy(cms_chain_cache *cache);
+
+/*
+ * cms_verify_signature
+ *
+ * Description:
+ *     Verify the CMS signature in the CSSLOT_SIGNATURESLOT blob of a Mach-O file: the
+ *     signer's certificate chain must be trusted for code signing, the signature over the
+ *     signed attributes must be valid, and the signed attributes must cover every code
+ *     directory (the messageDigest of the primary code directory and, for every code
+ *     directory whatever its hash type, the hash agility attributes).
+ *
+ * Parameters:
+ *     blobs               The signature blobs, from cs_find_signature_blobs().
+ *     cache               A chain cache, or NULL to always evaluate the chain.
+ */
+bool cms_verify_signature(const cs_signature_blobs *blobs, cms_chain_cache *cache);
+
+#endif /* cmssig_h */
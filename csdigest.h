@@ -0,0 +1,25 @@
+
+#ifndef csdigest_h
+#define csdigest_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The digests code signing uses. On Apple platforms these call CommonCrypto; everywhere else a
+ * portable implementation is built in, so that the cdhash code, the service and the benchmarks
+ * build and run on any POSIX system.
+ */
+enum {
+    CS_DIGEST_SHA1_LEN = 20,
+    CS_DIGEST_SHA256_LEN = 32,
+    CS_DIGEST_SHA384_LEN = 48,
+};
+
+void cs_digest_sha1(const void *data, size_t length, uint8_t *digest);
+
+void cs_digest_sha256(const void *data, size_t length, uint8_t *digest);
+
+void cs_digest_sha384(const void *data, size_t length, uint8_t *digest);
+
+#endif /* csdigest_h */
@@ -0,0 +1,315 @@
+
+/*
+ * File sources
+ * ------------
+ *
+ *  A small vtable so the cdhash reader can be pointed at either a real file or an in-memory
+ *  image with a latency model.
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesource.h"
+
+// ---- POSIX backend ----------------------------------------------------------------------------
+
+typedef struct file_source_posix {
+    file_source base;
+    int fd;
+} file_source_posix;
+
+static long
+posix_pread(file_source *src, void *buf, size_t length, uint64_t offset) {
+    file_source_posix *ps = (file_source_posix *)src;
+    return pread(ps->fd, buf, length, (off_t)offset);
+}
+
+static void
+posix_prefetch(file_source *src, uint64_t offset, uint64_t length) {
+    file_source_posix *ps = (file_source_posix *)src;
+#if defined(F_RDADVISE)
+    struct radvisory advice = { .ra_offset = (off_t)offset, .ra_count = (int)length };
+    fcntl(ps->fd, F_RDADVISE, &advice);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(ps->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+#else
+    (void)ps; (void)offset; (void)length;
+#endif
+}
+
+static bool
+posix_stat(file_source *src, struct stat *st) {
+    file_source_posix *ps = (file_source_posix *)src;
+    return fstat(ps->fd, st) == 0;
+}
+
+static void
+posix_close(file_source *src) {
+    file_source_posix *ps = (file_source_posix *)src;
+    close(ps->fd);
+    free(ps);
+}
+
+static const struct file_source_ops posix_ops = {
+    .pread = posix_pread,
+    .prefetch = posix_prefetch,
+    .stat = posix_stat,
+    .close = posix_close,
+};
+
+file_source *
+file_source_open_path(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    file_source_posix *ps = calloc(1, sizeof(*ps));
+    if (ps == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ps->base.ops = &posix_ops;
+    ps->base.size = st.st_size;
+    ps->fd = fd;
+    return &ps->base;
+}
+
+// ---- Memory backend ---------------------------------------------------------------------------
+
+typedef struct file_source_memory {
+    file_source base;
+    const uint8_t *data;
+    file_source_latency latency;
+    uint64_t page_count;
+    pthread_mutex_t lock;
+    uint64_t *warm_at;        // per page: when it enters the modeled page cache
+    file_source_stats stats;
+} file_source_memory;
+
+struct file_source_device {
+    pthread_mutex_t lock;
+    uint64_t busy_until;      // when the last transfer reserved on it finishes
+};
+
+// warm_at of a page that is not in the modeled page cache and not being read.
+#define MEMORY_PAGE_COLD UINT64_MAX
+
+// Spend the modeled time of an operation.
+static void
+memory_charge(file_source_memory *ms, uint64_t ns) {
+    if (ns == 0) {
+        return;
+    }
+    if (ms->latency.charge != NULL) {
+        ms->latency.charge(ms->latency.charge_ctx, ns);
+        return;
+    }
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+// Account for one operation over a range and warm its pages. Returns the cost in nanoseconds.
+static uint64_t
+memory_account(file_source_memory *ms, uint64_t offset, uint64_t length, bool prefetch) {
+    uint64_t now = (ms->latency.now != NULL ? ms->latency.now(ms->latency.charge_ctx) : 0);
+    uint64_t ns = ms->latency.op_ns;
+    pthread_mutex_lock(&ms->lock);
+    if (length != 0) {
+        uint64_t first = offset / ms->latency.page_size;
+        uint64_t last = (offset + length - 1) / ms->latency.page_size;
+        for (uint64_t page = first; page <= last; page++) {
+            uint64_t warm_at = ms->warm_at[page];
+            if (warm_at == MEMORY_PAGE_COLD) {
+                ns += ms->latency.cold_page_ns;
+                ms->warm_at[page] = (ms->latency.now != NULL ? now + ns : 0);
+                ms->stats.cold_pages++;
+            } else if (warm_at > now + ns) {
+                // Still being read by an earlier operation; wait for it.
+                ns = warm_at - now;
+            }
+        }
+    }
+    if (ms->latency.bytes_per_sec != 0) {
+        uint64_t transfer = length * 1000000000ull / ms->latency.bytes_per_sec;
+        file_source_device *device = ms->latency.device;
+        if (device != NULL && ms->latency.now != NULL) {
+            // Queue behind the transfers already reserved on the device.
+            uint64_t start = now + ns;
+            pthread_mutex_lock(&device->lock);
+            if (device->busy_until > start) {
+                start = device->busy_until;
+            }
+            device->busy_until = start + transfer;
+            pthread_mutex_unlock(&device->lock);
+            ns = start + transfer - now;
+        } else {
+            ns += transfer;
+        }
+    }
+    ms->stats.ops++;
+    ms->stats.prefetch_ops += prefetch;
+    ms->stats.bytes += length;
+    ms->stats.charged_ns += ns;
+    pthread_mutex_unlock(&ms->lock);
+    return ns;
+}
+
+static long
+memory_pread(file_source *src, void *buf, size_t length, uint64_t offset) {
+    file_source_memory *ms = (file_source_memory *)src;
+    if (offset >= src->size) {
+        return 0;
+    }
+    if (length > src->size - offset) {
+        length = src->size - offset;
+    }
+    memory_charge(ms, memory_account(ms, offset, length, false));
+    memcpy(buf, ms->data + offset, length);
+    return (long)length;
+}
+
+static void
+memory_prefetch(file_source *src, uint64_t offset, uint64_t length) {
+    file_source_memory *ms = (file_source_memory *)src;
+    if (ms->latency.ignore_prefetch || offset >= src->size) {
+        return;
+    }
+    if (length > src->size - offset) {
+        length = src->size - offset;
+    }
+    // Prefetching is one operation that pays for the whole range up front.
+    memory_charge(ms, memory_account(ms, offset, length, true));
+}
+
+static void
+memory_close(file_source *src) {
+    file_source_memory *ms = (file_source_memory *)src;
+    pthread_mutex_destroy(&ms->lock);
+    free(ms->warm_at);
+    free(ms);
+}
+
+static const struct file_source_ops memory_ops = {
+    .pread = memory_pread,
+    .prefetch = memory_prefetch,
+    .close = memory_close,
+};
+
+file_source *
+file_source_create_memory(const void *data, size_t size, const file_source_latency *latency) {
+    file_source_memory *ms = calloc(1, sizeof(*ms));
+    if (ms == NULL) {
+        return NULL;
+    }
+    if (latency != NULL) {
+        ms->latency = *latency;
+    }
+    if (ms->latency.page_size == 0) {
+        ms->latency.page_size = 0x4000;
+    }
+    ms->page_count = (size + ms->latency.page_size - 1) / ms->latency.page_size;
+    ms->warm_at = malloc((ms->page_count + 1) * sizeof(*ms->warm_at));
+    if (ms->warm_at == NULL) {
+        free(ms);
+        return NULL;
+    }
+    for (uint64_t page = 0; page <= ms->page_count; page++) {
+        ms->warm_at[page] = MEMORY_PAGE_COLD;
+    }
+    pthread_mutex_init(&ms->lock, NULL);
+    ms->base.ops = &memory_ops;
+    ms->base.size = size;
+    ms->data = data;
+    return &ms->base;
+}
+
+file_source_device *
+file_source_device_create(void) {
+    file_source_device *device = calloc(1, sizeof(*device));
+    if (device != NULL) {
+        pthread_mutex_init(&device->lock, NULL);
+    }
+    return device;
+}
+
+void
+file_source_device_destroy(file_source_device *device) {
+    if (device == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+}
+
+void
+file_source_memory_set_warm(file_source *src, bool warm) {
+    if (src->ops != &memory_ops) {
+        return;
+    }
+    file_source_memory *ms = (file_source_memory *)src;
+    pthread_mutex_lock(&ms->lock);
+    for (uint64_t page = 0; page <= ms->page_count; page++) {
+        ms->warm_at[page] = (warm ? 0 : MEMORY_PAGE_COLD);
+    }
+    pthread_mutex_unlock(&ms->lock);
+}
+
+void
+file_source_memory_get_stats(file_source *src, file_source_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (src->ops != &memory_ops) {
+        return;
+    }
+    file_source_memory *ms = (file_source_memory *)src;
+    pthread_mutex_lock(&ms->lock);
+    *stats = ms->stats;
+    pthread_mutex_unlock(&ms->lock);
+}
+
+// ---- Common -----------------------------------------------------------------------------------
+
+bool
+file_source_read(file_source *src, void *buf, size_t length, uint64_t offset) {
+    uint8_t *p = buf;
+    while (length > 0) {
+        long n = src->ops->pread(src, p, length, offset);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+void
+file_source_prefetch(file_source *src, uint64_t offset, uint64_t length) {
+    if (src->ops->prefetch != NULL) {
+        src->ops->prefetch(src, offset, length);
+    }
+}
+
+bool
+file_source_stat(file_source *src, struct stat *st) {
+    return src->ops->stat != NULL && src->ops->stat(src, st);
+}
+
+void
+file_source_close(file_source *src) {
+    if (src != NULL) {
+        src->ops->close(src);
+    }
+}
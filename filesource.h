@@ -0,0 +1,150 @@
+
+#ifndef filesource_h
+#define filesource_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+/*
+ * A file source is where the cdhash reader gets file contents from. The POSIX backend reads a
+ * real file with pread(); the memory backend serves a buffer and charges modeled I/O time for
+ * every operation, so I/O patterns can be compared reproducibly without depending on the disk
+ * or the state of the page cache.
+ */
+typedef struct file_source file_source;
+
+/*
+ * A modeled storage device shared by memory sources. Sources given the same device transfer
+ * their bytes at its bandwidth one after another, as reads of files on one disk would, rather
+ * than each at the full bandwidth.
+ */
+typedef struct file_source_device file_source_device;
+
+struct file_source_ops {
+    // Read up to length bytes at offset. Returns the number of bytes read, or -1 on error.
+    long (*pread)(file_source *src, void *buf, size_t length, uint64_t offset);
+    // Hint that a range will be read soon. May be NULL.
+    void (*prefetch)(file_source *src, uint64_t offset, uint64_t length);
+    // Get the identity of the underlying file. May be NULL.
+    bool (*stat)(file_source *src, struct stat *st);
+    void (*close)(file_source *src);
+};
+
+struct file_source {
+    const struct file_source_ops *ops;
+    uint64_t size;
+};
+
+/*
+ * file_source_latency
+ *
+ * Description:
+ *     The cost model of the memory backend. Every read costs op_ns plus its size at
+ *     bytes_per_sec, plus cold_page_ns for each page that is not yet in the modeled page
+ *     cache. Pages become warm once read or prefetched.
+ *
+ *     The time is spent by calling charge(charge_ctx, ns); if charge is NULL the calling
+ *     thread sleeps for that long. Simulators pass a charge function that advances a virtual
+ *     clock instead, and a now function that reads it. With a clock, a page read becomes warm
+ *     only at the virtual time its read finishes, and a read of a page that another read is
+ *     still bringing in waits for that read rather than paying for the page again.
+ *
+ *     With a clock, sources that share a device queue their transfers on it: a transfer starts
+ *     once the device has finished the ones reserved before it. Transfers are reserved in the
+ *     order the reads are made. Without a clock or a device, each read transfers at
+ *     bytes_per_sec on its own.
+ *
+ *     Set ignore_prefetch to turn prefetch hints into no-ops, so that the same reader can be
+ *     measured with and without them.
+ */
+typedef struct file_source_latency {
+    uint64_t op_ns;
+    uint64_t bytes_per_sec;        // 0 => unlimited
+    uint64_t cold_page_ns;
+    uint32_t page_size;            // 0 => 0x4000
+    bool ignore_prefetch;
+    void (*charge)(void *ctx, uint64_t ns);
+    uint64_t (*now)(void *ctx);    // NULL => pages warm as soon as they are read
+    void *charge_ctx;
+    file_source_device *device;    // NULL => not shared
+} file_source_latency;
+
+/*
+ * file_source_stats
+ *
+ * Description:
+ *     Counters kept by the memory backend.
+ */
+typedef struct file_source_stats {
+    uint64_t ops;
+    uint64_t prefetch_ops;
+    uint64_t bytes;
+    uint64_t cold_pages;
+    uint64_t charged_ns;
+} file_source_stats;
+
+/*
+ * file_source_open_path
+ *
+ * Description:
+ *     Open a file on disk as a file source. Returns NULL on failure.
+ */
+file_source *file_source_open_path(const char *path);
+
+/*
+ * file_source_create_memory
+ *
+ * Description:
+ *     Create a file source backed by a buffer, with the given cost model. The buffer is not
+ *     copied and must outlive the source. All pages start cold. Pass NULL for latency to
+ *     serve reads at no cost.
+ */
+file_source *file_source_create_memory(const void *data, size_t size,
+        const file_source_latency *latency);
+
+/*
+ * file_source_device_create
+ *
+ * Description:
+ *     Create an idle device for memory sources to share. It must outlive the sources.
+ */
+file_source_device *file_source_device_create(void);
+
+void file_source_device_destroy(file_source_device *device);
+
+/*
+ * file_source_memory_set_warm
+ *
+ * Description:
+ *     Mark every page of a memory source warm (true) or cold (false), modeling a warm or
+ *     dropped page cache.
+ */
+void file_source_memory_set_warm(file_source *src, bool warm);
+
+void file_source_memory_get_stats(file_source *src, file_source_stats *stats);
+
+/*
+ * file_source_read
+ *
+ * Description:
+ *     Read exactly length bytes at offset. Returns false on error or short read.
+ */
+bool file_source_read(file_source *src, void *buf, size_t length, uint64_t offset);
+
+void file_source_prefetch(file_source *src, uint64_t offset, uint64_t length);
+
+/*
+ * file_source_stat
+ *
+ * Description:
+ *     fstat() the file a source reads from, so that a caller can tie what it read to the file
+ *     it actually opened rather than to whatever the path names now. Returns false for sources
+ *     that aren't backed by a file.
+ */
+bool file_source_stat(file_source *src, struct stat *st);
+
+void file_source_close(file_source *src);
+
+#endif /* filesource_h */
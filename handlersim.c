@@ -0,0 +1,567 @@
+
+/*
+ * Handler simulation
+ * ------------------
+ *
+ *  Events are processed in virtual time order from a heap: request arrivals, batch windows
+ *  closing, and request completions. A worker takes the oldest waiting requests when it is
+ *  idle and, with batching, keeps collecting arrivals until its window closes or the batch is
+ *  full. Each request checks the cache when it starts and a miss fills the cache only when it
+ *  completes, so a request that overlaps a miss on the same binary misses too. Modeled pages
+ *  likewise only become warm when the read that brings them in finishes.
+ *
+ *  All the binaries live on one modeled device, so the storage bandwidth is shared by every
+ *  worker: a miss that reads while another worker's reads are in flight waits its turn.
+ *
+ *  The cache is an LRU keyed by the interned path ID of the binary.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "cdhash.h"
+#include "handlersim.h"
+#include "pathintern.h"
+
+// The virtual clock that file sources charge their I/O time to.
+typedef struct handlersim_clock {
+    uint64_t now_ns;
+} handlersim_clock;
+
+static void
+handlersim_charge(void *context, uint64_t ns) {
+    ((handlersim_clock *)context)->now_ns += ns;
+}
+
+static uint64_t
+handlersim_now(void *context) {
+    return ((handlersim_clock *)context)->now_ns;
+}
+
+// xorshift64*, so runs are reproducible across platforms.
+static uint64_t
+handlersim_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+// A uniform double in (0, 1].
+static double
+handlersim_uniform(uint64_t *state) {
+    return ((handlersim_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// ---- LRU cache --------------------------------------------------------------------------------
+
+typedef struct handlersim_cache {
+    unsigned capacity;
+    unsigned count;
+    uint32_t *slot_of;           // indexed by path ID; 0 => not cached, else slot + 1
+    path_id *id;                 // indexed by slot
+    unsigned *prev, *next;       // LRU list by slot; head is most recent
+    unsigned head, tail;
+} handlersim_cache;
+
+#define HANDLERSIM_NIL ((unsigned)-1)
+
+static void
+handlersim_cache_destroy(handlersim_cache *cache) {
+    free(cache->slot_of);
+    free(cache->id);
+    free(cache->prev);
+    free(cache->next);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static bool
+handlersim_cache_init(handlersim_cache *cache, unsigned capacity, uint32_t max_id) {
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = capacity;
+    cache->head = cache->tail = HANDLERSIM_NIL;
+    if (capacity == 0) {
+        return true;
+    }
+    cache->slot_of = calloc(max_id + 1, sizeof(*cache->slot_of));
+    cache->id = calloc(capacity, sizeof(*cache->id));
+    cache->prev = calloc(capacity, sizeof(*cache->prev));
+    cache->next = calloc(capacity, sizeof(*cache->next));
+    if (!cache->slot_of || !cache->id || !cache->prev || !cache->next) {
+        handlersim_cache_destroy(cache);
+        return false;
+    }
+    return true;
+}
+
+static void
+handlersim_cache_unlink(handlersim_cache *cache, unsigned slot) {
+    if (cache->prev[slot] != HANDLERSIM_NIL) {
+        cache->next[cache->prev[slot]] = cache->next[slot];
+    } else {
+        cache->head = cache->next[slot];
+    }
+    if (cache->next[slot] != HANDLERSIM_NIL) {
+        cache->prev[cache->next[slot]] = cache->prev[slot];
+    } else {
+        cache->tail = cache->prev[slot];
+    }
+}
+
+static void
+handlersim_cache_push(handlersim_cache *cache, unsigned slot) {
+    cache->prev[slot] = HANDLERSIM_NIL;
+    cache->next[slot] = cache->head;
+    if (cache->head != HANDLERSIM_NIL) {
+        cache->prev[cache->head] = slot;
+    }
+    cache->head = slot;
+    if (cache->tail == HANDLERSIM_NIL) {
+        cache->tail = slot;
+    }
+}
+
+// Look up a path, making it most recently used. Returns whether it was cached.
+static bool
+handlersim_cache_lookup(handlersim_cache *cache, path_id id) {
+    if (cache->capacity == 0 || cache->slot_of[id] == 0) {
+        return false;
+    }
+    unsigned slot = cache->slot_of[id] - 1;
+    handlersim_cache_unlink(cache, slot);
+    handlersim_cache_push(cache, slot);
+    return true;
+}
+
+static void
+handlersim_cache_insert(handlersim_cache *cache, path_id id) {
+    if (cache->capacity == 0 || cache->slot_of[id] != 0) {
+        return;
+    }
+    unsigned slot;
+    if (cache->count < cache->capacity) {
+        slot = cache->count++;
+    } else {
+        slot = cache->tail;
+        handlersim_cache_unlink(cache, slot);
+        cache->slot_of[cache->id[slot]] = 0;
+    }
+    cache->id[slot] = id;
+    cache->slot_of[id] = slot + 1;
+    handlersim_cache_push(cache, slot);
+}
+
+// ---- Simulation -------------------------------------------------------------------------------
+
+static int
+handlersim_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+handlersim_percentile(const uint64_t *sorted, uint64_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t index = (uint64_t)ceil(p * count);
+    return sorted[index == 0 ? 0 : index - 1];
+}
+
+// ---- Events -----------------------------------------------------------------------------------
+
+typedef enum handlersim_event_kind {
+    // At equal times completions go first, so that a result is cached before a lookup made at
+    // the same instant, then batch windows closing, then arrivals.
+    HANDLERSIM_EVENT_DONE,
+    HANDLERSIM_EVENT_CLOSE,
+    HANDLERSIM_EVENT_ARRIVAL,
+} handlersim_event_kind;
+
+typedef struct handlersim_event {
+    uint64_t time;
+    uint64_t seq;
+    handlersim_event_kind kind;
+    unsigned worker;
+    uint64_t request;            // DONE and ARRIVAL: the request; CLOSE: the window
+    bool insert;                 // DONE: cache the request's result
+} handlersim_event;
+
+// A binary min-heap of pending events.
+typedef struct handlersim_heap {
+    handlersim_event *events;
+    size_t count;
+    size_t capacity;
+    uint64_t seq;
+} handlersim_heap;
+
+static bool
+handlersim_event_before(const handlersim_event *a, const handlersim_event *b) {
+    if (a->time != b->time) {
+        return a->time < b->time;
+    }
+    if (a->kind != b->kind) {
+        return a->kind < b->kind;
+    }
+    return a->seq < b->seq;
+}
+
+static bool
+handlersim_heap_push(handlersim_heap *heap, handlersim_event event) {
+    if (heap->count == heap->capacity) {
+        size_t capacity = heap->capacity ? 2 * heap->capacity : 64;
+        handlersim_event *events = realloc(heap->events, capacity * sizeof(*events));
+        if (events == NULL) {
+            return false;
+        }
+        heap->events = events;
+        heap->capacity = capacity;
+    }
+    event.seq = heap->seq++;
+    size_t i = heap->count++;
+    while (i > 0 && handlersim_event_before(&event, &heap->events[(i - 1) / 2])) {
+        heap->events[i] = heap->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->events[i] = event;
+    return true;
+}
+
+static handlersim_event
+handlersim_heap_pop(handlersim_heap *heap) {
+    handlersim_event top = heap->events[0];
+    handlersim_event last = heap->events[--heap->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count
+                && handlersim_event_before(&heap->events[child + 1], &heap->events[child])) {
+            child++;
+        }
+        if (!handlersim_event_before(&heap->events[child], &last)) {
+            break;
+        }
+        heap->events[i] = heap->events[child];
+        i = child;
+    }
+    if (heap->count != 0) {
+        heap->events[i] = last;
+    }
+    return top;
+}
+
+// ---- Simulation -------------------------------------------------------------------------------
+
+typedef struct handlersim_worker {
+    bool busy;                   // serving a batch or collecting one
+    bool collecting;
+    uint64_t window;             // the current batch window, to spot stale CLOSE events
+    uint64_t batch_next;         // the next request of its batch to serve
+    uint64_t batch_end;          // one past the last request of its batch
+} handlersim_worker;
+
+typedef struct handlersim_state {
+    const handlersim_config *config;
+    handlersim_result *result;
+    handlersim_clock clock;
+    handlersim_cache cache;
+    handlersim_heap heap;
+    handlersim_worker *workers;
+    file_source **sources;
+    path_id *ids;
+    const unsigned *image;
+    const uint64_t *arrival;
+    uint64_t *latency;
+    uint64_t requests;
+    uint64_t arrived;            // requests that have arrived so far
+    uint64_t assigned;           // requests that have been put in a batch
+    unsigned collector;          // the worker with an open batch window, or HANDLERSIM_NIL
+    uint64_t last_completion;
+    bool ok;
+} handlersim_state;
+
+static void
+handlersim_schedule(handlersim_state *st, handlersim_event event) {
+    if (!handlersim_heap_push(&st->heap, event)) {
+        st->ok = false;
+    }
+}
+
+// Start serving the worker's next request at virtual time now. The cache is consulted now,
+// but a miss only fills it when the request completes.
+static void
+handlersim_start_request(handlersim_state *st, unsigned w, uint64_t now) {
+    uint64_t r = st->workers[w].batch_next;
+    path_id id = st->ids[st->image[r]];
+    st->clock.now_ns = now + st->config->per_request_ns;
+    handlersim_event done = { .kind = HANDLERSIM_EVENT_DONE, .worker = w, .request = r };
+    if (handlersim_cache_lookup(&st->cache, id)) {
+        st->result->cache_hits++;
+    } else {
+        file_source *source = st->sources[st->image[r]];
+        file_source_stats before, after;
+        file_source_memory_get_stats(source, &before);
+        uint8_t cdhash[CS_CDHASH_LEN];
+        done.insert = compute_cdhash_source(source, cdhash);
+        if (!done.insert) {
+            st->result->failed++;
+        }
+        file_source_memory_get_stats(source, &after);
+        st->clock.now_ns += (uint64_t)(st->config->hash_ns_per_byte
+                * (after.bytes - before.bytes));
+    }
+    done.time = st->clock.now_ns;
+    handlersim_schedule(st, done);
+}
+
+static void
+handlersim_serve_batch(handlersim_state *st, unsigned w, uint64_t now) {
+    st->result->batches++;
+    handlersim_start_request(st, w, now + st->config->per_batch_ns);
+}
+
+static bool
+handlersim_batch_full(handlersim_state *st, unsigned w) {
+    const handlersim_worker *worker = &st->workers[w];
+    return st->config->batch_max != 0
+        && worker->batch_end - worker->batch_next == st->config->batch_max;
+}
+
+// Hand waiting requests to idle workers. Without batching a batch is a single request; with
+// batching, one worker at a time holds a window open and collects the arrivals.
+static void
+handlersim_dispatch(handlersim_state *st, uint64_t now) {
+    while (st->collector == HANDLERSIM_NIL && st->assigned < st->arrived) {
+        unsigned w = 0;
+        while (w < st->config->workers && st->workers[w].busy) {
+            w++;
+        }
+        if (w == st->config->workers) {
+            return;
+        }
+        handlersim_worker *worker = &st->workers[w];
+        uint64_t take = 1;
+        if (st->config->batch_window_ns != 0) {
+            take = st->arrived - st->assigned;
+            if (st->config->batch_max != 0 && take > st->config->batch_max) {
+                take = st->config->batch_max;
+            }
+        }
+        worker->busy = true;
+        worker->batch_next = st->assigned;
+        worker->batch_end = st->assigned + take;
+        st->assigned += take;
+        if (st->config->batch_window_ns == 0 || handlersim_batch_full(st, w)) {
+            handlersim_serve_batch(st, w, now);
+            continue;
+        }
+        worker->collecting = true;
+        worker->window++;
+        st->collector = w;
+        handlersim_event close = {
+            .time = now + st->config->batch_window_ns,
+            .kind = HANDLERSIM_EVENT_CLOSE,
+            .worker = w,
+            .request = worker->window,
+        };
+        handlersim_schedule(st, close);
+    }
+}
+
+// Close the open batch window and start serving the batch.
+static void
+handlersim_close_window(handlersim_state *st, unsigned w, uint64_t now) {
+    st->workers[w].collecting = false;
+    st->collector = HANDLERSIM_NIL;
+    handlersim_serve_batch(st, w, now);
+}
+
+static void
+handlersim_handle(handlersim_state *st, const handlersim_event *event) {
+    uint64_t now = event->time;
+    handlersim_worker *worker = &st->workers[event->worker];
+    switch (event->kind) {
+        case HANDLERSIM_EVENT_ARRIVAL: {
+            st->arrived = event->request + 1;
+            if (st->arrived < st->requests) {
+                handlersim_event next = {
+                    .time = st->arrival[st->arrived],
+                    .kind = HANDLERSIM_EVENT_ARRIVAL,
+                    .request = st->arrived,
+                };
+                handlersim_schedule(st, next);
+            }
+            unsigned c = st->collector;
+            if (c != HANDLERSIM_NIL) {
+                st->workers[c].batch_end++;
+                st->assigned++;
+                if (handlersim_batch_full(st, c)) {
+                    handlersim_close_window(st, c, now);
+                }
+            }
+            break;
+        }
+        case HANDLERSIM_EVENT_CLOSE:
+            if (!worker->collecting || worker->window != event->request) {
+                return;
+            }
+            handlersim_close_window(st, event->worker, now);
+            break;
+        case HANDLERSIM_EVENT_DONE:
+            if (event->insert) {
+                handlersim_cache_insert(&st->cache, st->ids[st->image[event->request]]);
+            }
+            st->latency[event->request] = now - st->arrival[event->request];
+            if (now > st->last_completion) {
+                st->last_completion = now;
+            }
+            if (++worker->batch_next < worker->batch_end) {
+                handlersim_start_request(st, event->worker, now);
+                return;
+            }
+            worker->busy = false;
+            break;
+    }
+    handlersim_dispatch(st, now);
+}
+
+bool
+handlersim_run(const handlersim_config *config, const handlersim_workload *workload,
+        handlersim_result *result) {
+    memset(result, 0, sizeof(*result));
+    if (config->workers == 0 || workload->image_count == 0 || workload->requests == 0
+            || workload->arrivals_per_sec <= 0) {
+        return false;
+    }
+    unsigned images = workload->image_count;
+    uint64_t requests = workload->requests;
+    handlersim_state st;
+    memset(&st, 0, sizeof(st));
+    st.config = config;
+    st.result = result;
+    st.requests = requests;
+    st.collector = HANDLERSIM_NIL;
+    st.ok = true;
+    file_source_latency storage = config->storage;
+    storage.charge = handlersim_charge;
+    storage.now = handlersim_now;
+    storage.charge_ctx = &st.clock;
+    storage.device = file_source_device_create();
+
+    bool ok = false;
+    path_interner *paths = path_interner_create(images * 64, images * 1024);
+    double *cdf = calloc(images, sizeof(*cdf));
+    uint64_t *arrival = calloc(requests, sizeof(*arrival));
+    unsigned *image = calloc(requests, sizeof(*image));
+    st.sources = calloc(images, sizeof(*st.sources));
+    st.ids = calloc(images, sizeof(*st.ids));
+    st.latency = calloc(requests, sizeof(*st.latency));
+    st.workers = calloc(config->workers, sizeof(*st.workers));
+    if (!storage.device || !paths || !cdf || !arrival || !image || !st.sources || !st.ids
+            || !st.latency || !st.workers) {
+        goto out;
+    }
+    st.arrival = arrival;
+    st.image = image;
+    // Every binary starts cold in the modeled page cache.
+    path_id max_id = 0;
+    for (unsigned i = 0; i < images; i++) {
+        st.sources[i] = file_source_create_memory(workload->images[i],
+                workload->image_sizes[i], &storage);
+        st.ids[i] = path_intern(paths, workload->paths[i]);
+        if (st.sources[i] == NULL || st.ids[i] == PATH_ID_NONE) {
+            goto out;
+        }
+        if (st.ids[i] > max_id) {
+            max_id = st.ids[i];
+        }
+    }
+    if (!handlersim_cache_init(&st.cache, config->cache_entries, max_id)) {
+        goto out;
+    }
+    // Generate the arrivals.
+    double total = 0;
+    for (unsigned i = 0; i < images; i++) {
+        total += 1.0 / pow(i + 1, workload->zipf_s);
+        cdf[i] = total;
+    }
+    uint64_t rng = workload->seed ? workload->seed : 0x9e3779b97f4a7c15ull;
+    double t = 0;
+    for (uint64_t r = 0; r < requests; r++) {
+        t += -log(handlersim_uniform(&rng)) / workload->arrivals_per_sec * 1e9;
+        arrival[r] = (uint64_t)t;
+        double u = handlersim_uniform(&rng) * total;
+        unsigned lo = 0, hi = images - 1;
+        while (lo < hi) {
+            unsigned mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        image[r] = lo;
+    }
+    // Run the events in virtual time order. Arrivals are scheduled one at a time, so the
+    // heap only ever holds one arrival and an event or two per worker.
+    handlersim_event first = { .time = arrival[0], .kind = HANDLERSIM_EVENT_ARRIVAL };
+    handlersim_schedule(&st, first);
+    while (st.ok && st.heap.count != 0) {
+        handlersim_event event = handlersim_heap_pop(&st.heap);
+        handlersim_handle(&st, &event);
+    }
+    if (!st.ok) {
+        goto out;
+    }
+    result->completed = requests;
+    result->elapsed_ns = st.last_completion - arrival[0];
+    result->throughput = result->elapsed_ns ? requests * 1e9 / result->elapsed_ns : 0;
+    qsort(st.latency, requests, sizeof(*st.latency), handlersim_compare_u64);
+    result->p50_ns = handlersim_percentile(st.latency, requests, 0.50);
+    result->p99_ns = handlersim_percentile(st.latency, requests, 0.99);
+    result->p999_ns = handlersim_percentile(st.latency, requests, 0.999);
+    result->max_ns = st.latency[requests - 1];
+    ok = true;
+out:
+    handlersim_cache_destroy(&st.cache);
+    for (unsigned i = 0; st.sources != NULL && i < images; i++) {
+        file_source_close(st.sources[i]);
+    }
+    path_interner_destroy(paths);
+    file_source_device_destroy(storage.device);
+    free(st.heap.events);
+    free(st.sources);
+    free(st.ids);
+    free(st.latency);
+    free(st.workers);
+    free(cdf);
+    free(arrival);
+    free(image);
+    return ok;
+}
+
+void
+handlersim_sweep(const handlersim_config *configs, unsigned count,
+        const handlersim_workload *workload, FILE *out) {
+    fprintf(out, "%-24s %7s %7s %10s %12s %8s %10s %10s %10s %10s\n",
+            "config", "workers", "cache", "window_us", "req/s", "hit%",
+            "p50_us", "p99_us", "p999_us", "max_us");
+    for (unsigned i = 0; i < count; i++) {
+        const handlersim_config *c = &configs[i];
+        handlersim_result r;
+        if (!handlersim_run(c, workload, &r)) {
+            fprintf(out, "%-24s failed\n", c->name ? c->name : "");
+            continue;
+        }
+        fprintf(out, "%-24s %7u %7u %10.1f %12.0f %8.1f %10.1f %10.1f %10.1f %10.1f\n",
+                c->name ? c->name : "", c->workers, c->cache_entries,
+                c->batch_window_ns / 1e3, r.throughput, 100.0 * r.cache_hits / r.completed,
+                r.p50_ns / 1e3, r.p99_ns / 1e3, r.p999_ns / 1e3, r.max_ns / 1e3);
+    }
+}
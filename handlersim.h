@@ -0,0 +1,86 @@
+
+#ifndef handlersim_h
+#define handlersim_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "filesource.h"
+
+/*
+ * A discrete-event model of the amfid request handler for capacity planning. Requests arrive
+ * on a virtual clock and are served by a pool of workers with an optional cdhash cache and
+ * batching window. A cache miss runs the real compute_cdhash_source() against in-memory
+ * images whose file sources charge modeled I/O time to the virtual clock, plus a modeled hash
+ * cost. Nothing sleeps, so a configuration simulating minutes of load runs in well under a
+ * second.
+ *
+ * The cost parameters are meant to be taken from measurements: per_request_ns from the
+ * handler's round trip, hash_ns_per_byte from the "cdhash" row of perfctr_report(), and the
+ * storage model from the device class being sized.
+ */
+typedef struct handlersim_config {
+    const char *name;
+    unsigned workers;
+    unsigned cache_entries;         // 0 => no cache
+    uint64_t batch_window_ns;       // 0 => no batching
+    unsigned batch_max;             // 0 => unlimited
+    uint64_t per_request_ns;        // fixed handler cost of every request
+    uint64_t per_batch_ns;          // fixed cost of every batch
+    double hash_ns_per_byte;        // charged for the bytes read on a cache miss
+    file_source_latency storage;    // one device for all images; charge, now, charge_ctx and
+                                    // device are ignored
+} handlersim_config;
+
+/*
+ * handlersim_workload
+ *
+ * Description:
+ *     The binaries requests are drawn from and the arrival process. Requests arrive as a
+ *     Poisson process and pick a binary with a Zipf distribution of exponent zipf_s (0 for
+ *     uniform), in the order given.
+ */
+typedef struct handlersim_workload {
+    const void *const *images;
+    const size_t *image_sizes;
+    const char *const *paths;
+    unsigned image_count;
+    double arrivals_per_sec;
+    double zipf_s;
+    uint64_t requests;
+    uint64_t seed;
+} handlersim_workload;
+
+typedef struct handlersim_result {
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t cache_hits;
+    uint64_t batches;
+    uint64_t elapsed_ns;            // virtual time from first arrival to last completion
+    double throughput;              // completed requests per virtual second
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} handlersim_result;
+
+/*
+ * handlersim_run
+ *
+ * Description:
+ *     Simulate a workload against one configuration.
+ */
+bool handlersim_run(const handlersim_config *config, const handlersim_workload *workload,
+        handlersim_result *result);
+
+/*
+ * handlersim_sweep
+ *
+ * Description:
+ *     Simulate a workload against each configuration and print a row per configuration.
+ */
+void handlersim_sweep(const handlersim_config *configs, unsigned count,
+        const handlersim_workload *workload, FILE *out);
+
+#endif /* handlersim_h */
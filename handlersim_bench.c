@@ -0,0 +1,183 @@
+
+/*
+ * Handler simulation driver
+ * -------------------------
+ *
+ *  Sweeps handlersim over worker counts, with and without the cdhash cache and with and
+ *  without batching, for a workload of signed Mach-O files. Each file can stand for several
+ *  distinct binaries, so that a handful of files can model a system with many binaries and a
+ *  cache smaller than their number. The images are read into memory up front; their I/O and
+ *  hashing are modeled, so the figures are in virtual time.
+ *
+ *  Build it with `make handlersim_bench` and run it against one or more signed Mach-O files:
+ *
+ *      handlersim_bench [-n requests] [-a arrivals_per_sec] [-z zipf_s] [-s seed]
+ *          [-m binaries_per_file] [-c cache_entries] [-W batch_window_us] [-M batch_max]
+ *          [-r per_request_us] [-B per_batch_us] [-H hash_ns_per_byte]
+ *          [-b storage_mb_per_sec] [-o storage_op_us] [-C cold_page_us] file...
+ *
+ *  The storage bandwidth is that of one device shared by all workers.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handlersim.h"
+
+static const unsigned bench_worker_counts[] = { 1, 2, 4, 8 };
+#define BENCH_WORKER_COUNTS (sizeof(bench_worker_counts) / sizeof(bench_worker_counts[0]))
+
+static uint8_t *
+bench_read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = malloc(st.st_size);
+    }
+    size_t done = 0;
+    while (data != NULL && done < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    *size = done;
+    return data;
+}
+
+static void
+bench_usage(void) {
+    fprintf(stderr, "usage: handlersim_bench [-n requests] [-a arrivals_per_sec] [-z zipf_s] "
+            "[-s seed] [-m binaries_per_file] [-c cache_entries] [-W batch_window_us] "
+            "[-M batch_max] [-r per_request_us] [-B per_batch_us] [-H hash_ns_per_byte] "
+            "[-b storage_mb_per_sec] [-o storage_op_us] [-C cold_page_us] file...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv) {
+    handlersim_workload workload = {
+        .arrivals_per_sec = 2000,
+        .zipf_s = 1.0,
+        .requests = 100000,
+    };
+    handlersim_config base = {
+        .cache_entries = 256,
+        .batch_window_ns = 1000000,
+        .batch_max = 32,
+        .per_request_ns = 50000,
+        .per_batch_ns = 20000,
+        .hash_ns_per_byte = 1.0,
+        .storage = {
+            .op_ns = 100000,
+            .bytes_per_sec = 500000000,
+            .cold_page_ns = 0,
+        },
+    };
+    unsigned per_file = 1;
+    int ch;
+    while ((ch = getopt(argc, argv, "n:a:z:s:m:c:W:M:r:B:H:b:o:C:")) != -1) {
+        double value = strtod(optarg, NULL);
+        switch (ch) {
+            case 'n': workload.requests = (uint64_t)value; break;
+            case 'a': workload.arrivals_per_sec = value; break;
+            case 'z': workload.zipf_s = value; break;
+            case 's': workload.seed = (uint64_t)value; break;
+            case 'm': per_file = (unsigned)value; break;
+            case 'c': base.cache_entries = (unsigned)value; break;
+            case 'W': base.batch_window_ns = (uint64_t)(value * 1e3); break;
+            case 'M': base.batch_max = (unsigned)value; break;
+            case 'r': base.per_request_ns = (uint64_t)(value * 1e3); break;
+            case 'B': base.per_batch_ns = (uint64_t)(value * 1e3); break;
+            case 'H': base.hash_ns_per_byte = value; break;
+            case 'b': base.storage.bytes_per_sec = (uint64_t)(value * 1e6); break;
+            case 'o': base.storage.op_ns = (uint64_t)(value * 1e3); break;
+            case 'C': base.storage.cold_page_ns = (uint64_t)(value * 1e3); break;
+            default: bench_usage();
+        }
+    }
+    if (optind == argc || workload.requests == 0 || workload.arrivals_per_sec <= 0
+            || per_file == 0 || base.batch_window_ns == 0) {
+        bench_usage();
+    }
+    unsigned files = (unsigned)(argc - optind);
+    unsigned count = files * per_file;
+    const void **images = calloc(count, sizeof(*images));
+    size_t *sizes = calloc(count, sizeof(*sizes));
+    char **paths = calloc(count, sizeof(*paths));
+    if (images == NULL || sizes == NULL || paths == NULL) {
+        return 1;
+    }
+    // The copies of a file share its image but are distinct binaries to the cache, under
+    // the file's real path plus a copy number.
+    for (unsigned f = 0; f < files; f++) {
+        const char *file = argv[optind + f];
+        char real[PATH_MAX];
+        size_t size;
+        uint8_t *data = bench_read_file(file, &size);
+        if (data == NULL || realpath(file, real) == NULL) {
+            fprintf(stderr, "handlersim_bench: can't read %s\n", file);
+            return 1;
+        }
+        for (unsigned k = 0; k < per_file; k++) {
+            unsigned i = f * per_file + k;
+            images[i] = data;
+            sizes[i] = size;
+            size_t length = strlen(real) + 16;
+            paths[i] = malloc(length);
+            if (paths[i] == NULL) {
+                return 1;
+            }
+            snprintf(paths[i], length, "%s/%u", real, k);
+        }
+    }
+    workload.images = images;
+    workload.image_sizes = sizes;
+    workload.paths = (const char *const *)paths;
+    workload.image_count = count;
+
+    // For each worker count: no cache, the cache, and the cache with batching.
+    handlersim_config configs[3 * BENCH_WORKER_COUNTS];
+    char names[3 * BENCH_WORKER_COUNTS][32];
+    unsigned n = 0;
+    for (unsigned i = 0; i < BENCH_WORKER_COUNTS; i++) {
+        unsigned workers = bench_worker_counts[i];
+        for (unsigned variant = 0; variant < 3; variant++, n++) {
+            configs[n] = base;
+            configs[n].workers = workers;
+            if (variant == 0) {
+                configs[n].cache_entries = 0;
+            }
+            if (variant != 2) {
+                configs[n].batch_window_ns = 0;
+            }
+            static const char *variant_names[] = { "no cache", "cache", "cache+batch" };
+            snprintf(names[n], sizeof(names[n]), "%u workers, %s", workers,
+                    variant_names[variant]);
+            configs[n].name = names[n];
+        }
+    }
+    printf("%u binaries from %u files, %llu requests at %.0f/s, zipf %.2f, storage %.0f MB/s "
+            "shared\n", count, files, (unsigned long long)workload.requests,
+            workload.arrivals_per_sec, workload.zipf_s, base.storage.bytes_per_sec / 1e6);
+    handlersim_sweep(configs, n, &workload, stdout);
+    return 0;
+}
@@ -0,0 +1,263 @@
+
+/*
+ * Lazy page verification
+ * ----------------------
+ *
+ *  The mapping is anonymous memory registered with userfaultfd in missing mode. A handler
+ *  thread reads the fault events, verifies the signed part of the faulting page against the
+ *  CodeDirectory, and fills the page with UFFDIO_COPY from the verifier's copy of the file.
+ *  Pages past the signed range (the signature itself) are copied without a check.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lazyverify.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct cs_lazy_mapping {
+    cs_page_verifier *pv;
+    uint8_t *base;
+    size_t length;
+    size_t page_size;
+    int uffd;
+    int stop_fd;
+    pthread_t thread;
+    uint8_t *bounce;                // one page, for the partial page at the end of the file
+    uint64_t faults;
+    uint64_t failed_pages;
+    bool failed;                    // a fault could not be resolved; see cs_lazy_fail()
+};
+
+// Verify the signed part of a page of the mapping.
+static bool
+cs_lazy_verify_page(cs_lazy_mapping *map, uint64_t offset) {
+    cs_page_verifier *pv = map->pv;
+    if (offset >= pv->code_limit) {
+        return true;
+    }
+    uint64_t length = pv->code_limit - offset;
+    if (length > map->page_size) {
+        length = map->page_size;
+    }
+    return cs_page_verify_range(pv, offset, length);
+}
+
+// Give up on the whole mapping: unregistering it wakes every thread blocked on a fault in it,
+// and later faults are then served with zeros by the kernel, never with unverified contents.
+static void
+cs_lazy_fail(cs_lazy_mapping *map) {
+    __atomic_store_n(&map->failed, true, __ATOMIC_RELAXED);
+    struct uffdio_range range = { .start = (uint64_t)(uintptr_t)map->base, .len = map->length };
+    ioctl(map->uffd, UFFDIO_UNREGISTER, &range);
+}
+
+// Resolve a fault with an ioctl, retrying while the kernel asks for it. EEXIST means the page
+// was filled already, which also wakes the faulting thread.
+static bool
+cs_lazy_resolve(cs_lazy_mapping *map, unsigned long request, void *arg) {
+    for (;;) {
+        if (ioctl(map->uffd, request, arg) == 0 || errno == EEXIST) {
+            return true;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+// Fill a faulting page: with the file contents if it verified, with zeros if not. If the page
+// can't be filled at all, the mapping is failed so that the faulting thread doesn't hang.
+static void
+cs_lazy_fill_page(cs_lazy_mapping *map, uint64_t address) {
+    uint64_t offset = address - (uint64_t)(uintptr_t)map->base;
+    __atomic_fetch_add(&map->faults, 1, __ATOMIC_RELAXED);
+    if (!cs_lazy_verify_page(map, offset)) {
+        __atomic_fetch_add(&map->failed_pages, 1, __ATOMIC_RELAXED);
+        struct uffdio_zeropage zero = {
+            .range = { .start = address, .len = map->page_size },
+        };
+        if (!cs_lazy_resolve(map, UFFDIO_ZEROPAGE, &zero)) {
+            cs_lazy_fail(map);
+        }
+        return;
+    }
+    const uint8_t *src = map->pv->file + offset;
+    if (map->pv->size - offset < map->page_size) {
+        size_t tail = map->pv->size - offset;
+        memcpy(map->bounce, src, tail);
+        memset(map->bounce + tail, 0, map->page_size - tail);
+        src = map->bounce;
+    }
+    struct uffdio_copy copy = {
+        .dst = address,
+        .src = (uint64_t)(uintptr_t)src,
+        .len = map->page_size,
+    };
+    if (!cs_lazy_resolve(map, UFFDIO_COPY, &copy)) {
+        cs_lazy_fail(map);
+    }
+}
+
+// Serve page faults until the mapping is torn down.
+static void *
+cs_lazy_fault_handler(void *arg) {
+    cs_lazy_mapping *map = arg;
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = map->uffd, .events = POLLIN },
+            { .fd = map->stop_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        struct uffd_msg msg;
+        ssize_t n = read(map->uffd, &msg, sizeof(msg));
+        if (n != sizeof(msg)) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            uint64_t address = msg.arg.pagefault.address & ~(uint64_t)(map->page_size - 1);
+            cs_lazy_fill_page(map, address);
+        }
+    }
+    return NULL;
+}
+
+cs_lazy_mapping *
+cs_lazy_map(cs_page_verifier *pv) {
+    cs_lazy_mapping *map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->pv = pv;
+    map->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    map->length = (pv->size + map->page_size - 1) & ~(map->page_size - 1);
+    map->uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    map->stop_fd = eventfd(0, EFD_CLOEXEC);
+    map->base = MAP_FAILED;
+    map->bounce = malloc(map->page_size);
+    if (map->uffd < 0 || map->stop_fd < 0 || map->bounce == NULL) {
+        goto fail;
+    }
+    struct uffdio_api api = { .api = UFFD_API };
+    if (ioctl(map->uffd, UFFDIO_API, &api) != 0) {
+        goto fail;
+    }
+    map->base = mmap(NULL, map->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+    if (map->base == MAP_FAILED) {
+        goto fail;
+    }
+    struct uffdio_register reg = {
+        .range = { .start = (uint64_t)(uintptr_t)map->base, .len = map->length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(map->uffd, UFFDIO_REGISTER, &reg) != 0
+            || pthread_create(&map->thread, NULL, cs_lazy_fault_handler, map) != 0) {
+        goto fail;
+    }
+    return map;
+fail:
+    if (map->base != MAP_FAILED) {
+        munmap(map->base, map->length);
+    }
+    if (map->uffd >= 0) {
+        close(map->uffd);
+    }
+    if (map->stop_fd >= 0) {
+        close(map->stop_fd);
+    }
+    free(map->bounce);
+    free(map);
+    return NULL;
+}
+
+const void *
+cs_lazy_mapping_address(cs_lazy_mapping *map) {
+    return map->base;
+}
+
+bool
+cs_lazy_mapping_ok(cs_lazy_mapping *map) {
+    return __atomic_load_n(&map->failed_pages, __ATOMIC_RELAXED) == 0
+        && !__atomic_load_n(&map->failed, __ATOMIC_RELAXED);
+}
+
+void
+cs_lazy_mapping_get_stats(cs_lazy_mapping *map, cs_lazy_mapping_stats *stats) {
+    stats->faults = __atomic_load_n(&map->faults, __ATOMIC_RELAXED);
+    stats->failed_pages = __atomic_load_n(&map->failed_pages, __ATOMIC_RELAXED);
+}
+
+void
+cs_lazy_unmap(cs_lazy_mapping *map) {
+    if (map == NULL) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t n = write(map->stop_fd, &one, sizeof(one));
+    (void)n;
+    pthread_join(map->thread, NULL);
+    munmap(map->base, map->length);
+    close(map->uffd);
+    close(map->stop_fd);
+    free(map->bounce);
+    free(map);
+}
+
+#else
+
+cs_lazy_mapping *
+cs_lazy_map(cs_page_verifier *pv) {
+    (void)pv;
+    errno = ENOSYS;
+    return NULL;
+}
+
+const void *
+cs_lazy_mapping_address(cs_lazy_mapping *map) {
+    (void)map;
+    return NULL;
+}
+
+bool
+cs_lazy_mapping_ok(cs_lazy_mapping *map) {
+    (void)map;
+    return false;
+}
+
+void
+cs_lazy_mapping_get_stats(cs_lazy_mapping *map, cs_lazy_mapping_stats *stats) {
+    (void)map;
+    memset(stats, 0, sizeof(*stats));
+}
+
+void
+cs_lazy_unmap(cs_lazy_mapping *map) {
+    (void)map;
+}
+
+#endif
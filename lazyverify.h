@@ -0,0 +1,60 @@
+#ifndef lazyverify_h
+#define lazyverify_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cdhash.h"
+
+/*
+ * A lazy mapping is a copy of a Mach-O file whose pages are filled in on first touch. Each
+ * first touch is caught with userfaultfd and checked with cs_page_verify_range() before the
+ * page is mapped in, so only the pages a process actually uses are ever hashed. This needs
+ * userfaultfd and therefore Linux; elsewhere cs_lazy_map() always fails.
+ */
+typedef struct cs_lazy_mapping cs_lazy_mapping;
+
+/*
+ * cs_lazy_mapping_stats
+ *
+ * Description:
+ *     Counters kept by the fault handler.
+ */
+typedef struct cs_lazy_mapping_stats {
+    uint64_t faults;
+    uint64_t failed_pages;
+} cs_lazy_mapping_stats;
+
+/*
+ * cs_lazy_map
+ *
+ * Description:
+ *     Create a lazy mapping of the file a verifier was initialized with. The verifier must
+ *     outlive the mapping. Returns NULL if userfaultfd is unavailable.
+ */
+cs_lazy_mapping *cs_lazy_map(cs_page_verifier *pv);
+
+/*
+ * cs_lazy_mapping_address
+ *
+ * Description:
+ *     The start of the mapping. Reading any byte of it faults in and verifies its page.
+ */
+const void *cs_lazy_mapping_address(cs_lazy_mapping *map);
+
+/*
+ * cs_lazy_mapping_ok
+ *
+ * Description:
+ *     Whether every page touched so far matched its code slot and could be mapped in. A page
+ *     that failed is mapped in as zeros, so that the touching thread does not hang, and the
+ *     mapping stays failed. If a page can't be mapped in at all, the whole mapping is failed
+ *     and every page not yet mapped in reads as zeros from then on.
+ */
+bool cs_lazy_mapping_ok(cs_lazy_mapping *map);
+
+void cs_lazy_mapping_get_stats(cs_lazy_mapping *map, cs_lazy_mapping_stats *stats);
+
+void cs_lazy_unmap(cs_lazy_mapping *map);
+
+#endif /* lazyverify_h */
@@ -0,0 +1,280 @@
+
+/*
+ * Lazy verification benchmark
+ * ---------------------------
+ *
+ *  Compares eager page verification, where every page of the signed range is hashed before the
+ *  binary may run, with a lazy mapping from cs_lazy_map(), where a page is hashed the first
+ *  time it is touched. For each file it reports the time to first instruction, that is until
+ *  the byte at the entry point can be read, and the total hash work after touching a given
+ *  share of the pages, the way a process that uses only part of a large binary would.
+ *
+ *  The file is read into memory before anything is timed, so only verification is measured.
+ *  The lazy mapping needs userfaultfd; where it is unavailable only eager verification is
+ *  reported.
+ *
+ *  Build it with `make lazyverify_bench` and run it against one or more signed Mach-O files:
+ *
+ *      lazyverify_bench [-r runs] [-t touched_percent] [-P] file...
+ *
+ *  -P prints the per-stage performance counters for the eager and the lazy runs. It needs a
+ *  build with them, `make clean && make PERFCTR=1 lazyverify_bench`.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lazyverify.h"
+#include "macho_defs.h"
+#include "perfctr.h"
+
+typedef struct bench_result {
+    uint64_t first_instruction_ns;
+    uint64_t total_ns;
+    uint64_t pages_hashed;
+    uint64_t bytes_hashed;
+    bool mapped;
+    bool ok;
+} bench_result;
+
+static uint64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t *
+bench_read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = malloc(st.st_size);
+    }
+    size_t done = 0;
+    while (data != NULL && done < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    *size = done;
+    return data;
+}
+
+// The file offset of the first instruction: LC_MAIN's entry point, or failing that the start
+// of the first executable segment.
+static uint64_t
+bench_entry_offset(const uint8_t *file, size_t size) {
+    const struct mach_header_64 *mh = (const struct mach_header_64 *)file;
+    const uint8_t *lc_p = (const uint8_t *)(mh + 1);
+    const uint8_t *lc_end = lc_p + mh->sizeofcmds;
+    uint64_t exec_fileoff = 0;
+    bool have_exec = false;
+    while (lc_p + sizeof(struct load_command) <= lc_end) {
+        const struct load_command *lc = (const struct load_command *)lc_p;
+        if (lc->cmdsize < sizeof(*lc) || lc->cmdsize > (size_t)(lc_end - lc_p)) {
+            break;
+        }
+        if (lc->cmd == LC_MAIN && lc->cmdsize >= sizeof(struct entry_point_command)) {
+            uint64_t entryoff = ((const struct entry_point_command *)lc)->entryoff;
+            if (entryoff < size) {
+                return entryoff;
+            }
+        } else if (lc->cmd == LC_SEGMENT_64 && lc->cmdsize >= sizeof(struct segment_command_64)
+                && !have_exec) {
+            const struct segment_command_64 *seg = (const struct segment_command_64 *)lc;
+            if ((seg->initprot & VM_PROT_EXECUTE) && seg->filesize != 0 && seg->fileoff < size) {
+                exec_fileoff = seg->fileoff;
+                have_exec = true;
+            }
+        }
+        lc_p += lc->cmdsize;
+    }
+    return exec_fileoff;
+}
+
+// Read touched_percent of the signed pages, spread evenly over the file, the way a process
+// that uses only part of a large binary would.
+static void
+bench_touch_pages(const volatile uint8_t *base, const cs_page_verifier *pv,
+        unsigned touched_percent) {
+    uint32_t count = (uint32_t)(((uint64_t)pv->page_count * touched_percent + 99) / 100);
+    volatile uint8_t sink = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        sink += base[(uint64_t)i * pv->page_count / count * pv->page_size];
+    }
+    (void)sink;
+}
+
+static void
+bench_eager(const uint8_t *file, size_t size, unsigned touched_percent, bench_result *result) {
+    memset(result, 0, sizeof(*result));
+    uint64_t entry = bench_entry_offset(file, size);
+    uint64_t start = bench_now_ns();
+    cs_page_verifier pv;
+    if (!cs_page_verifier_init(&pv, file, size)) {
+        return;
+    }
+    bool ok = cs_page_verify_range(&pv, 0, pv.code_limit);
+    volatile uint8_t first = file[entry];
+    (void)first;
+    result->first_instruction_ns = bench_now_ns() - start;
+    bench_touch_pages(file, &pv, touched_percent);
+    result->total_ns = bench_now_ns() - start;
+    result->pages_hashed = pv.pages_hashed;
+    result->bytes_hashed = (uint64_t)pv.pages_hashed * pv.page_size;
+    result->mapped = true;
+    result->ok = ok;
+    cs_page_verifier_destroy(&pv);
+}
+
+static void
+bench_lazy(const uint8_t *file, size_t size, unsigned touched_percent, bench_result *result) {
+    memset(result, 0, sizeof(*result));
+    uint64_t entry = bench_entry_offset(file, size);
+    uint64_t start = bench_now_ns();
+    cs_page_verifier pv;
+    if (!cs_page_verifier_init(&pv, file, size)) {
+        return;
+    }
+    cs_lazy_mapping *map = cs_lazy_map(&pv);
+    if (map == NULL) {
+        cs_page_verifier_destroy(&pv);
+        return;
+    }
+    result->mapped = true;
+    const volatile uint8_t *base = cs_lazy_mapping_address(map);
+    volatile uint8_t first = base[entry];
+    (void)first;
+    result->first_instruction_ns = bench_now_ns() - start;
+    // The fault handler hashes each page as it is first touched.
+    bench_touch_pages(base, &pv, touched_percent);
+    result->total_ns = bench_now_ns() - start;
+    result->pages_hashed = pv.pages_hashed;
+    result->bytes_hashed = (uint64_t)pv.pages_hashed * pv.page_size;
+    result->ok = cs_lazy_mapping_ok(map);
+    cs_lazy_unmap(map);
+    cs_page_verifier_destroy(&pv);
+}
+
+static void
+bench_print(const char *name, const bench_result *results, unsigned runs, uint32_t page_count) {
+    uint64_t first = UINT64_MAX, total = UINT64_MAX;
+    for (unsigned i = 0; i < runs; i++) {
+        if (results[i].first_instruction_ns < first) {
+            first = results[i].first_instruction_ns;
+        }
+        if (results[i].total_ns < total) {
+            total = results[i].total_ns;
+        }
+    }
+    printf("  %-5s first instruction %10.1f us, total %10.1f us, hashed %u/%u pages "
+            "(%llu bytes)\n", name, first / 1e3, total / 1e3,
+            (unsigned)results[0].pages_hashed, page_count,
+            (unsigned long long)results[0].bytes_hashed);
+}
+
+static void
+bench_usage(void) {
+    fprintf(stderr, "usage: lazyverify_bench [-r runs] [-t touched_percent] [-P] file...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv) {
+    unsigned runs = 5;
+    unsigned touched_percent = 10;
+    bool perf = false;
+    int ch;
+    while ((ch = getopt(argc, argv, "r:t:P")) != -1) {
+        unsigned value = (optarg != NULL ? (unsigned)strtoul(optarg, NULL, 0) : 0);
+        switch (ch) {
+            case 'r': runs = value; break;
+            case 't': touched_percent = value; break;
+            case 'P': perf = true; break;
+            default: bench_usage();
+        }
+    }
+#ifndef CDHASH_PERFCTR
+    if (perf) {
+        fprintf(stderr, "lazyverify_bench: -P needs a build with CDHASH_PERFCTR "
+                "(make clean && make PERFCTR=1)\n");
+        return 2;
+    }
+#endif
+    if (optind == argc || runs == 0 || touched_percent > 100) {
+        bench_usage();
+    }
+    bench_result *eager = calloc(runs, sizeof(*eager));
+    bench_result *lazy = calloc(runs, sizeof(*lazy));
+    if (eager == NULL || lazy == NULL) {
+        return 1;
+    }
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        size_t size;
+        uint8_t *file = bench_read_file(argv[i], &size);
+        cs_page_verifier pv;
+        if (file == NULL || !cs_page_verifier_init(&pv, file, size)) {
+            fprintf(stderr, "lazyverify_bench: %s: not a signed Mach-O file\n", argv[i]);
+            free(file);
+            status = 1;
+            continue;
+        }
+        uint32_t page_count = pv.page_count;
+        cs_page_verifier_destroy(&pv);
+        bool eager_ok = true, lazy_ok = true, have_lazy = true;
+        printf("%s: %zu bytes, %u pages, %u%% touched, best of %u\n", argv[i], size, page_count,
+                touched_percent, runs);
+        perfctr_reset();
+        for (unsigned run = 0; run < runs; run++) {
+            bench_eager(file, size, touched_percent, &eager[run]);
+            eager_ok = eager_ok && eager[run].ok;
+        }
+        bench_print("eager", eager, runs, page_count);
+        if (perf) {
+            perfctr_report(stdout);
+        }
+        perfctr_reset();
+        for (unsigned run = 0; run < runs; run++) {
+            bench_lazy(file, size, touched_percent, &lazy[run]);
+            have_lazy = have_lazy && lazy[run].mapped;
+            lazy_ok = lazy_ok && lazy[run].ok;
+        }
+        if (have_lazy) {
+            bench_print("lazy", lazy, runs, page_count);
+            if (perf) {
+                perfctr_report(stdout);
+            }
+        } else {
+            printf("  lazy  unavailable, userfaultfd can't be used here\n");
+        }
+        if (!eager_ok || (have_lazy && !lazy_ok)) {
+            printf("  verification failed\n");
+            status = 1;
+        }
+        free(file);
+    }
+    free(eager);
+    free(lazy);
+    return status;
+}
@@ -0,0 +1,86 @@
+
+#ifndef macho_defs_h
+#define macho_defs_h
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+/*
+ * The Mach-O definitions the cdhash code uses. On Apple platforms they come from the SDK;
+ * elsewhere the few structures and constants needed are defined here, with the layouts and
+ * values of <mach-o/loader.h> and <mach/machine.h>, so the code can be built off Darwin.
+ */
+#if defined(__APPLE__)
+
+#include <mach/machine.h>
+#include <mach-o/loader.h>
+
+#else
+
+typedef int cpu_type_t;
+typedef int cpu_subtype_t;
+typedef int vm_prot_t;
+
+#define CPU_ARCH_ABI64          0x01000000
+#define CPU_TYPE_X86_64         (7 | CPU_ARCH_ABI64)
+#define CPU_TYPE_ARM64          (12 | CPU_ARCH_ABI64)
+
+#define VM_PROT_READ            0x01
+#define VM_PROT_WRITE           0x02
+#define VM_PROT_EXECUTE         0x04
+
+#define MH_MAGIC_64             0xfeedfacf
+#define MH_EXECUTE              0x2
+
+#define LC_REQ_DYLD             0x80000000
+#define LC_SEGMENT_64           0x19
+#define LC_CODE_SIGNATURE       0x1d
+#define LC_MAIN                 (0x28 | LC_REQ_DYLD)
+
+struct mach_header_64 {
+    uint32_t magic;
+    cpu_type_t cputype;
+    cpu_subtype_t cpusubtype;
+    uint32_t filetype;
+    uint32_t ncmds;
+    uint32_t sizeofcmds;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct load_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+};
+
+struct segment_command_64 {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    char segname[16];
+    uint64_t vmaddr;
+    uint64_t vmsize;
+    uint64_t fileoff;
+    uint64_t filesize;
+    vm_prot_t maxprot;
+    vm_prot_t initprot;
+    uint32_t nsects;
+    uint32_t flags;
+};
+
+struct linkedit_data_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t dataoff;
+    uint32_t datasize;
+};
+
+struct entry_point_command {
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint64_t entryoff;
+    uint64_t stacksize;
+};
+
+#endif
+
+#endif /* macho_defs_h */
@@ -0,0 +1,257 @@
+
+/*
+ * Path interning
+ * --------------
+ *
+ *  Each path component is a node holding its parent's ID and an offset into a shared text
+ *  arena. Nodes are found through an open-addressed hash table keyed on (parent, component).
+ *  Writers serialize on a mutex and publish a node by storing its ID into a table slot with
+ *  release ordering; readers probe the table with acquire loads and never block. Nodes are
+ *  never removed, so an ID stays valid for the life of the interner.
+ *
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "pathintern.h"
+
+typedef struct path_node {
+    path_id parent;
+    uint32_t hash;
+    uint32_t text_offset;
+    uint16_t text_length;
+    uint16_t depth_length;    // length of the full path up to and including this component
+    _Atomic bool is_path;
+} path_node;
+
+struct path_interner {
+    pthread_mutex_t lock;
+    path_node *nodes;          // indexed by ID; node 0 is unused
+    uint32_t max_nodes;
+    _Atomic uint32_t node_count;
+    _Atomic path_id *table;
+    uint32_t table_mask;
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    _Atomic uint32_t path_count;
+    _Atomic size_t raw_bytes;
+};
+
+// Hash a component together with its parent's ID (FNV-1a).
+static uint32_t
+path_component_hash(path_id parent, const char *component, size_t length) {
+    uint32_t hash = 2166136261u ^ parent;
+    hash *= 16777619u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)component[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Check whether a published node is the given component of the given parent.
+static bool
+path_node_matches(path_interner *pi, const path_node *node, path_id parent, uint32_t hash,
+        const char *component, size_t length) {
+    return node->hash == hash
+        && node->parent == parent
+        && node->text_length == length
+        && memcmp(pi->arena + node->text_offset, component, length) == 0;
+}
+
+// Find a component of a parent in the table. Lock-free.
+static path_id
+path_component_find(path_interner *pi, path_id parent, uint32_t hash,
+        const char *component, size_t length) {
+    for (uint32_t slot = hash & pi->table_mask; ; slot = (slot + 1) & pi->table_mask) {
+        path_id id = atomic_load_explicit(&pi->table[slot], memory_order_acquire);
+        if (id == PATH_ID_NONE) {
+            return PATH_ID_NONE;
+        }
+        if (path_node_matches(pi, &pi->nodes[id], parent, hash, component, length)) {
+            return id;
+        }
+    }
+}
+
+// Add a component of a parent. Must be called with the lock held.
+static path_id
+path_component_insert(path_interner *pi, path_id parent, uint32_t hash,
+        const char *component, size_t length) {
+    // Another writer may have added it while we were waiting for the lock.
+    path_id id = path_component_find(pi, parent, hash, component, length);
+    if (id != PATH_ID_NONE) {
+        return id;
+    }
+    size_t depth_length = length + 1;
+    if (parent != PATH_ID_NONE) {
+        depth_length += pi->nodes[parent].depth_length;
+    }
+    uint32_t count = atomic_load_explicit(&pi->node_count, memory_order_relaxed);
+    if (count + 1 >= pi->max_nodes
+            || length > UINT16_MAX
+            || depth_length > UINT16_MAX
+            || length > pi->arena_size - pi->arena_used) {
+        return PATH_ID_NONE;
+    }
+    id = count + 1;
+    path_node *node = &pi->nodes[id];
+    node->parent = parent;
+    node->hash = hash;
+    node->text_offset = (uint32_t) pi->arena_used;
+    node->text_length = (uint16_t) length;
+    node->depth_length = (uint16_t) depth_length;
+    atomic_init(&node->is_path, false);
+    memcpy(pi->arena + pi->arena_used, component, length);
+    pi->arena_used += length;
+    atomic_store_explicit(&pi->node_count, id, memory_order_relaxed);
+    // Publish the node.
+    uint32_t slot = hash & pi->table_mask;
+    while (atomic_load_explicit(&pi->table[slot], memory_order_relaxed) != PATH_ID_NONE) {
+        slot = (slot + 1) & pi->table_mask;
+    }
+    atomic_store_explicit(&pi->table[slot], id, memory_order_release);
+    return id;
+}
+
+// Walk the components of an absolute path, optionally inserting missing ones.
+static path_id
+path_walk(path_interner *pi, const char *path, bool insert) {
+    if (path[0] != '/') {
+        return PATH_ID_NONE;
+    }
+    path_id id = PATH_ID_NONE;
+    bool locked = false;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *end = strchr(p, '/');
+        size_t length = (end != NULL ? (size_t)(end - p) : strlen(p));
+        uint32_t hash = path_component_hash(id, p, length);
+        path_id next = path_component_find(pi, id, hash, p, length);
+        if (next == PATH_ID_NONE && insert) {
+            if (!locked) {
+                pthread_mutex_lock(&pi->lock);
+                locked = true;
+            }
+            next = path_component_insert(pi, id, hash, p, length);
+        }
+        if (next == PATH_ID_NONE) {
+            id = PATH_ID_NONE;
+            break;
+        }
+        id = next;
+        p += length;
+    }
+    if (locked) {
+        pthread_mutex_unlock(&pi->lock);
+    }
+    return id;
+}
+
+path_interner *
+path_interner_create(uint32_t max_components, size_t arena_size) {
+    if (max_components == 0 || max_components >= 0x40000000 || arena_size > UINT32_MAX) {
+        return NULL;
+    }
+    path_interner *pi = calloc(1, sizeof(*pi));
+    if (pi == NULL) {
+        return NULL;
+    }
+    // Keep the table at most half full so probe sequences stay short.
+    uint32_t table_size = 1;
+    while (table_size < 2 * (max_components + 1)) {
+        table_size <<= 1;
+    }
+    pi->max_nodes = max_components + 1;
+    pi->nodes = calloc(pi->max_nodes, sizeof(*pi->nodes));
+    pi->table = calloc(table_size, sizeof(*pi->table));
+    pi->table_mask = table_size - 1;
+    pi->arena = malloc(arena_size);
+    pi->arena_size = arena_size;
+    if (pi->nodes == NULL || pi->table == NULL || pi->arena == NULL) {
+        path_interner_destroy(pi);
+        return NULL;
+    }
+    pthread_mutex_init(&pi->lock, NULL);
+    return pi;
+}
+
+void
+path_interner_destroy(path_interner *pi) {
+    if (pi == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&pi->lock);
+    free(pi->nodes);
+    free((void *)pi->table);
+    free(pi->arena);
+    free(pi);
+}
+
+path_id
+path_intern(path_interner *pi, const char *path) {
+    path_id id = path_walk(pi, path, true);
+    if (id == PATH_ID_NONE) {
+        return PATH_ID_NONE;
+    }
+    // Account for the path the first time it is interned as a whole.
+    path_node *node = &pi->nodes[id];
+    if (!atomic_load_explicit(&node->is_path, memory_order_relaxed)
+            && !atomic_exchange(&node->is_path, true)) {
+        atomic_fetch_add(&pi->path_count, 1);
+        atomic_fetch_add(&pi->raw_bytes, node->depth_length + 1);
+    }
+    return id;
+}
+
+path_id
+path_intern_lookup(path_interner *pi, const char *path) {
+    path_id id = path_walk(pi, path, false);
+    if (id == PATH_ID_NONE || !atomic_load_explicit(&pi->nodes[id].is_path, memory_order_relaxed)) {
+        return PATH_ID_NONE;
+    }
+    return id;
+}
+
+size_t
+path_intern_copy(path_interner *pi, path_id id, char *buf, size_t size) {
+    uint32_t count = atomic_load_explicit(&pi->node_count, memory_order_acquire);
+    if (id == PATH_ID_NONE || id > count) {
+        return 0;
+    }
+    size_t length = pi->nodes[id].depth_length;
+    if (length + 1 > size) {
+        return 0;
+    }
+    // Fill the buffer from the last component backwards.
+    buf[length] = '\0';
+    char *p = buf + length;
+    for (path_id node_id = id; node_id != PATH_ID_NONE; node_id = pi->nodes[node_id].parent) {
+        const path_node *node = &pi->nodes[node_id];
+        p -= node->text_length;
+        memcpy(p, pi->arena + node->text_offset, node->text_length);
+        *--p = '/';
+    }
+    return length;
+}
+
+void
+path_interner_get_stats(path_interner *pi, path_interner_stats *stats) {
+    pthread_mutex_lock(&pi->lock);
+    stats->components = atomic_load(&pi->node_count);
+    stats->paths = atomic_load(&pi->path_count);
+    stats->raw_bytes = atomic_load(&pi->raw_bytes);
+    stats->used_bytes = pi->arena_used + stats->components * sizeof(path_node);
+    stats->allocated_bytes = sizeof(*pi) + pi->max_nodes * sizeof(path_node)
+        + ((size_t)pi->table_mask + 1) * sizeof(*pi->table) + pi->arena_size;
+    pthread_mutex_unlock(&pi->lock);
+}
@@ -0,0 +1,87 @@
+
+#ifndef pathintern_h
+#define pathintern_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A path interner maps absolute paths to stable 32-bit IDs. Paths are stored one component at
+ * a time as (parent ID, component) pairs, so the long shared prefixes (/Applications,
+ * /usr/lib, /System/Library/...) are stored once. Lookups never take a lock; only inserting a
+ * component that has not been seen before does.
+ */
+typedef struct path_interner path_interner;
+
+typedef uint32_t path_id;
+
+#define PATH_ID_NONE 0
+
+/*
+ * path_interner_stats
+ *
+ * Description:
+ *     Memory accounting for an interner. raw_bytes is what the interned paths would take as
+ *     separate NUL-terminated strings; used_bytes is the part of the node array and text
+ *     arena in use. allocated_bytes is everything the interner holds, including the hash
+ *     table and the unused parts of the preallocated nodes and arena, and is the figure to
+ *     compare raw_bytes against.
+ */
+typedef struct path_interner_stats {
+    uint32_t components;
+    uint32_t paths;
+    size_t raw_bytes;
+    size_t used_bytes;
+    size_t allocated_bytes;
+} path_interner_stats;
+
+/*
+ * path_interner_create
+ *
+ * Description:
+ *     Create an interner with room for max_components distinct path components and
+ *     arena_size bytes of component text. Both are fixed for the life of the interner.
+ */
+path_interner *path_interner_create(uint32_t max_components, size_t arena_size);
+
+void path_interner_destroy(path_interner *pi);
+
+/*
+ * path_intern
+ *
+ * Description:
+ *     Get the ID of an absolute path, adding it if necessary. Returns PATH_ID_NONE if the
+ *     path is not absolute or the interner is full.
+ */
+path_id path_intern(path_interner *pi, const char *path);
+
+/*
+ * path_intern_lookup
+ *
+ * Description:
+ *     Get the ID of an absolute path without adding it. Lock-free. Returns PATH_ID_NONE if
+ *     the path has not been interned.
+ */
+path_id path_intern_lookup(path_interner *pi, const char *path);
+
+/*
+ * path_intern_copy
+ *
+ * Description:
+ *     Write the path for an ID into buf as a NUL-terminated string.
+ *
+ * Parameters:
+ *     pi                  The interner.
+ *     id                  The path ID.
+ *     buf            out    On return, contains the path.
+ *     size                The size of buf.
+ *
+ * Returns:
+ *     The length of the path, or 0 if the ID is invalid or buf is too small.
+ */
+size_t path_intern_copy(path_interner *pi, path_id id, char *buf, size_t size);
+
+void path_interner_get_stats(path_interner *pi, path_interner_stats *stats);
+
+#endif /* pathintern_h */
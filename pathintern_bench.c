@@ -0,0 +1,267 @@
+
+/*
+ * Path interner benchmark
+ * -----------------------
+ *
+ *  Interns a list of paths and reports the memory the interner uses against keeping each path
+ *  as its own heap string, then times lookups of every path: through path_intern_lookup(), and
+ *  through an open-addressed table of heap strings as the baseline the interner replaces.
+ *  Lookups run on a number of threads at once, to show that interner lookups don't contend.
+ *
+ *  Build it with `make pathintern_bench` and run it against a file with one absolute path per
+ *  line, for example the output of `find /usr /Applications -type f`:
+ *
+ *      pathintern_bench [-r rounds] [-t threads] [-c max_components] [-a arena_size] file
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pathintern.h"
+
+// The baseline: each path as its own heap string, in an open-addressed table.
+typedef struct bench_string_table {
+    char **slots;
+    size_t mask;
+} bench_string_table;
+
+typedef struct bench_lookups {
+    path_interner *pi;
+    const bench_string_table *table;
+    char *const *paths;
+    size_t count;
+    unsigned rounds;
+    size_t found;
+    uint64_t elapsed_ns;
+} bench_lookups;
+
+static uint64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// FNV-1a, as the interner hashes its components.
+static size_t
+bench_string_hash(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s != '\0'; s++) {
+        hash ^= (uint8_t)*s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool
+bench_string_table_create(bench_string_table *table, char *const *paths, size_t count) {
+    size_t size = 1;
+    while (size < 2 * count) {
+        size <<= 1;
+    }
+    table->slots = calloc(size, sizeof(*table->slots));
+    table->mask = size - 1;
+    if (table->slots == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = bench_string_hash(paths[i]) & table->mask;
+        while (table->slots[slot] != NULL && strcmp(table->slots[slot], paths[i]) != 0) {
+            slot = (slot + 1) & table->mask;
+        }
+        if (table->slots[slot] == NULL) {
+            table->slots[slot] = strdup(paths[i]);
+            if (table->slots[slot] == NULL) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+bench_string_table_find(const bench_string_table *table, const char *path) {
+    for (size_t slot = bench_string_hash(path) & table->mask; ;
+            slot = (slot + 1) & table->mask) {
+        if (table->slots[slot] == NULL) {
+            return false;
+        }
+        if (strcmp(table->slots[slot], path) == 0) {
+            return true;
+        }
+    }
+}
+
+static void *
+bench_lookup_thread(void *arg) {
+    bench_lookups *lookups = arg;
+    uint64_t start = bench_now_ns();
+    size_t found = 0;
+    for (unsigned round = 0; round < lookups->rounds; round++) {
+        for (size_t i = 0; i < lookups->count; i++) {
+            if (lookups->pi != NULL) {
+                found += (path_intern_lookup(lookups->pi, lookups->paths[i]) != PATH_ID_NONE);
+            } else {
+                found += bench_string_table_find(lookups->table, lookups->paths[i]);
+            }
+        }
+    }
+    lookups->elapsed_ns = bench_now_ns() - start;
+    lookups->found = found;
+    return NULL;
+}
+
+// Look every path up rounds times on each thread. Returns the average cost of a lookup.
+static double
+bench_lookups_run(path_interner *pi, const bench_string_table *table, char *const *paths,
+        size_t count, unsigned rounds, unsigned threads, bool *all_found) {
+    bench_lookups lookups[threads];
+    pthread_t thread_ids[threads];
+    bool started[threads];
+    for (unsigned t = 0; t < threads; t++) {
+        lookups[t] = (bench_lookups) {
+            .pi = pi, .table = table, .paths = paths, .count = count, .rounds = rounds,
+        };
+        started[t] = (pthread_create(&thread_ids[t], NULL, bench_lookup_thread,
+                &lookups[t]) == 0);
+        if (!started[t]) {
+            bench_lookup_thread(&lookups[t]);
+        }
+    }
+    uint64_t total_ns = 0;
+    *all_found = true;
+    for (unsigned t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(thread_ids[t], NULL);
+        }
+        total_ns += lookups[t].elapsed_ns;
+        *all_found = *all_found && lookups[t].found == (size_t)rounds * count;
+    }
+    return (double)total_ns / threads / ((double)rounds * count);
+}
+
+// Read the paths, one per line.
+static char **
+bench_read_paths(const char *file, size_t *count) {
+    FILE *f = fopen(file, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    char **paths = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, f)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (line[0] != '/') {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            char **grown = realloc(paths, capacity * sizeof(*paths));
+            if (grown == NULL) {
+                break;
+            }
+            paths = grown;
+        }
+        paths[*count] = strdup(line);
+        if (paths[*count] == NULL) {
+            break;
+        }
+        (*count)++;
+    }
+    free(line);
+    fclose(f);
+    return paths;
+}
+
+static void
+bench_usage(void) {
+    fprintf(stderr, "usage: pathintern_bench [-r rounds] [-t threads] [-c max_components] "
+            "[-a arena_size] file\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv) {
+    unsigned rounds = 10;
+    unsigned threads = 1;
+    uint32_t max_components = 0x100000;
+    size_t arena_size = 0x1000000;
+    int ch;
+    while ((ch = getopt(argc, argv, "r:t:c:a:")) != -1) {
+        unsigned long value = strtoul(optarg, NULL, 0);
+        switch (ch) {
+            case 'r': rounds = (unsigned)value; break;
+            case 't': threads = (unsigned)value; break;
+            case 'c': max_components = (uint32_t)value; break;
+            case 'a': arena_size = value; break;
+            default: bench_usage();
+        }
+    }
+    if (optind + 1 != argc || rounds == 0 || threads == 0 || threads > 256) {
+        bench_usage();
+    }
+    size_t count;
+    char **paths = bench_read_paths(argv[optind], &count);
+    if (paths == NULL || count == 0) {
+        fprintf(stderr, "pathintern_bench: no absolute paths in %s\n", argv[optind]);
+        return 1;
+    }
+    path_interner *pi = path_interner_create(max_components, arena_size);
+    if (pi == NULL) {
+        fprintf(stderr, "pathintern_bench: can't create the interner\n");
+        return 1;
+    }
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        if (path_intern(pi, paths[i]) == PATH_ID_NONE) {
+            fprintf(stderr, "pathintern_bench: the interner is full after %zu paths; "
+                    "raise -c or -a\n", i);
+            return 1;
+        }
+    }
+    uint64_t intern_ns = bench_now_ns() - start;
+    bench_string_table table;
+    if (!bench_string_table_create(&table, paths, count)) {
+        fprintf(stderr, "pathintern_bench: out of memory\n");
+        return 1;
+    }
+
+    path_interner_stats stats;
+    path_interner_get_stats(pi, &stats);
+    // The baseline keeps every distinct path as a string plus a pointer to it.
+    size_t string_bytes = stats.raw_bytes + stats.paths * sizeof(char *);
+    printf("%zu paths read, %u distinct, %u components\n", count, stats.paths, stats.components);
+    printf("  as heap strings:  %10zu bytes (%zu of text and %zu of pointers)\n", string_bytes,
+            stats.raw_bytes, stats.paths * sizeof(char *));
+    printf("  interner in use:  %10zu bytes, %.1f%% of the strings\n", stats.used_bytes,
+            100.0 * stats.used_bytes / string_bytes);
+    printf("  interner total:   %10zu bytes, including its preallocated table and arena\n",
+            stats.allocated_bytes);
+    printf("  interning:        %10.1f ns per path\n", (double)intern_ns / count);
+
+    bool interner_found, table_found;
+    double interner_ns = bench_lookups_run(pi, NULL, paths, count, rounds, threads,
+            &interner_found);
+    double table_ns = bench_lookups_run(NULL, &table, paths, count, rounds, threads,
+            &table_found);
+    printf("lookups, %u rounds on %u threads:\n", rounds, threads);
+    printf("  path_intern_lookup: %8.1f ns per lookup\n", interner_ns);
+    printf("  string table:       %8.1f ns per lookup\n", table_ns);
+    if (!interner_found || !table_found) {
+        fprintf(stderr, "pathintern_bench: a lookup failed\n");
+        return 1;
+    }
+    path_interner_destroy(pi);
+    return 0;
+}
@@ -0,0 +1,236 @@
+
+/*
+ * Performance counters
+ * --------------------
+ *
+ *  The counters are opened as one perf_event group per thread so that a single read() returns
+ *  a consistent snapshot of all of them. Platforms without perf_event record wall-clock time
+ *  only.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+typedef struct perfctr_totals {
+    uint64_t calls;
+    uint64_t bytes;
+    perfctr_sample sum;
+} perfctr_totals;
+
+static const char *perfctr_stage_names[PERFCTR_STAGE_COUNT] = {
+    [PERFCTR_STAGE_FILE]             = "file",
+    [PERFCTR_STAGE_MACHO_VALIDATE]   = "macho_validate",
+    [PERFCTR_STAGE_SUPERBLOB_SELECT] = "superblob_select",
+    [PERFCTR_STAGE_CDHASH]           = "cdhash",
+    [PERFCTR_STAGE_PAGE_HASH]        = "page_hash",
+};
+
+static pthread_mutex_t perfctr_lock = PTHREAD_MUTEX_INITIALIZER;
+static perfctr_totals perfctr_stage_totals[PERFCTR_STAGE_COUNT];
+static bool perfctr_have_counters;
+
+// The group leader for the calling thread: -1 if not yet opened, -2 if unavailable.
+static __thread int perfctr_group_fd = -1;
+
+#if defined(__linux__)
+
+// Every fd of a thread's group, closed by a key destructor when the thread exits.
+typedef struct perfctr_group {
+    int fds[PERFCTR_COUNTER_COUNT];
+} perfctr_group;
+
+static pthread_once_t perfctr_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t perfctr_key;
+static bool perfctr_key_ok;
+
+static void
+perfctr_group_destroy(void *arg) {
+    perfctr_group *group = arg;
+    for (int i = 0; i < PERFCTR_COUNTER_COUNT; i++) {
+        close(group->fds[i]);
+    }
+    free(group);
+}
+
+static void
+perfctr_key_create(void) {
+    perfctr_key_ok = (pthread_key_create(&perfctr_key, perfctr_group_destroy) == 0);
+}
+
+static int
+perfctr_open_event(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Open the counter group for the calling thread.
+static void
+perfctr_open(void) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERFCTR_COUNTER_COUNT] = {
+        [PERFCTR_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        [PERFCTR_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        [PERFCTR_L1D_MISSES]    = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                                    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        [PERFCTR_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        [PERFCTR_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    // Without a way to close the group when the thread exits, every short-lived thread
+    // would leak its fds, so go without counters instead.
+    pthread_once(&perfctr_key_once, perfctr_key_create);
+    perfctr_group *group = (perfctr_key_ok ? malloc(sizeof(*group)) : NULL);
+    if (group == NULL) {
+        perfctr_group_fd = -2;
+        return;
+    }
+    int *fds = group->fds;
+    int leader = -1;
+    for (int i = 0; i < PERFCTR_COUNTER_COUNT; i++) {
+        fds[i] = perfctr_open_event(events[i].type, events[i].config, leader);
+        if (fds[i] < 0) {
+            // All or nothing: a partial group would make the ratios meaningless.
+            for (int j = 0; j < i; j++) {
+                close(fds[j]);
+            }
+            free(group);
+            perfctr_group_fd = -2;
+            return;
+        }
+        if (leader < 0) {
+            leader = fds[i];
+        }
+    }
+    if (pthread_setspecific(perfctr_key, group) != 0) {
+        perfctr_group_destroy(group);
+        perfctr_group_fd = -2;
+        return;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perfctr_group_fd = leader;
+    pthread_mutex_lock(&perfctr_lock);
+    perfctr_have_counters = true;
+    pthread_mutex_unlock(&perfctr_lock);
+}
+
+static void
+perfctr_read(perfctr_sample *sample) {
+    if (perfctr_group_fd == -1) {
+        perfctr_open();
+    }
+    if (perfctr_group_fd < 0) {
+        return;
+    }
+    struct {
+        uint64_t count;
+        uint64_t values[PERFCTR_COUNTER_COUNT];
+    } group;
+    if (read(perfctr_group_fd, &group, sizeof(group)) != sizeof(group)) {
+        return;
+    }
+    memcpy(sample->counters, group.values, sizeof(sample->counters));
+}
+
+#else
+
+static void
+perfctr_read(perfctr_sample *sample) {
+    (void)sample;
+}
+
+#endif
+
+static uint64_t
+perfctr_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+perfctr_begin(perfctr_sample *sample) {
+    memset(sample, 0, sizeof(*sample));
+    perfctr_read(sample);
+    sample->ns = perfctr_now_ns();
+}
+
+void
+perfctr_end(perfctr_stage stage, const perfctr_sample *begin, uint64_t bytes) {
+    perfctr_sample end;
+    end.ns = perfctr_now_ns();
+    memset(end.counters, 0, sizeof(end.counters));
+    perfctr_read(&end);
+    pthread_mutex_lock(&perfctr_lock);
+    perfctr_totals *totals = &perfctr_stage_totals[stage];
+    totals->calls++;
+    totals->bytes += bytes;
+    totals->sum.ns += end.ns - begin->ns;
+    for (int i = 0; i < PERFCTR_COUNTER_COUNT; i++) {
+        totals->sum.counters[i] += end.counters[i] - begin->counters[i];
+    }
+    pthread_mutex_unlock(&perfctr_lock);
+}
+
+void
+perfctr_report(FILE *out) {
+    pthread_mutex_lock(&perfctr_lock);
+    fprintf(out, "%-18s %10s %12s %10s %10s %8s %8s %8s %8s %8s\n",
+            "stage", "calls", "bytes", "ns/call", "cyc/call", "cyc/B", "IPC",
+            "L1D/KB", "LLC/KB", "brmiss/KB");
+    for (int stage = 0; stage < PERFCTR_STAGE_COUNT; stage++) {
+        const perfctr_totals *t = &perfctr_stage_totals[stage];
+        if (t->calls == 0) {
+            continue;
+        }
+        const uint64_t *c = t->sum.counters;
+        double calls = (double)t->calls;
+        double kb = t->bytes / 1024.0;
+        if (!perfctr_have_counters) {
+            fprintf(out, "%-18s %10llu %12llu %10.0f\n", perfctr_stage_names[stage],
+                    (unsigned long long)t->calls, (unsigned long long)t->bytes,
+                    t->sum.ns / calls);
+            continue;
+        }
+        fprintf(out, "%-18s %10llu %12llu %10.0f %10.0f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+                perfctr_stage_names[stage],
+                (unsigned long long)t->calls, (unsigned long long)t->bytes,
+                t->sum.ns / calls,
+                c[PERFCTR_CYCLES] / calls,
+                t->bytes ? c[PERFCTR_CYCLES] / (double)t->bytes : 0.0,
+                c[PERFCTR_CYCLES] ? c[PERFCTR_INSTRUCTIONS] / (double)c[PERFCTR_CYCLES] : 0.0,
+                kb ? c[PERFCTR_L1D_MISSES] / kb : 0.0,
+                kb ? c[PERFCTR_LLC_MISSES] / kb : 0.0,
+                kb ? c[PERFCTR_BRANCH_MISSES] / kb : 0.0);
+    }
+    pthread_mutex_unlock(&perfctr_lock);
+}
+
+void
+perfctr_reset(void) {
+    pthread_mutex_lock(&perfctr_lock);
+    memset(perfctr_stage_totals, 0, sizeof(perfctr_stage_totals));
+    pthread_mutex_unlock(&perfctr_lock);
+}
@@ -0,0 +1,78 @@
+
+#ifndef perfctr_h
+#define perfctr_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hardware performance counters for the cdhash stages. When built with CDHASH_PERFCTR, each
+ * stage below is wrapped with a read of the cycle, instruction, L1D miss, LLC miss and branch
+ * miss counters (perf_event on Linux) and the wall clock, and the deltas are accumulated per
+ * stage. Without CDHASH_PERFCTR the PERFCTR_BEGIN/PERFCTR_END macros compile to nothing.
+ */
+typedef enum perfctr_stage {
+    PERFCTR_STAGE_FILE,                // a whole compute_cdhash() or compute_cdhash_source() call
+    PERFCTR_STAGE_MACHO_VALIDATE,
+    PERFCTR_STAGE_SUPERBLOB_SELECT,
+    PERFCTR_STAGE_CDHASH,              // hashing the code directory
+    PERFCTR_STAGE_PAGE_HASH,           // hashing a page for page verification
+    PERFCTR_STAGE_COUNT,
+} perfctr_stage;
+
+enum {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_L1D_MISSES,
+    PERFCTR_LLC_MISSES,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_COUNTER_COUNT,
+};
+
+typedef struct perfctr_sample {
+    uint64_t ns;
+    uint64_t counters[PERFCTR_COUNTER_COUNT];
+} perfctr_sample;
+
+/*
+ * perfctr_begin
+ *
+ * Description:
+ *     Take a sample at the start of a stage. The counters are opened for the calling thread
+ *     the first time it takes a sample; if they can't be opened, only time is recorded.
+ */
+void perfctr_begin(perfctr_sample *sample);
+
+/*
+ * perfctr_end
+ *
+ * Description:
+ *     Take a sample at the end of a stage and add the difference to the stage's totals.
+ *
+ * Parameters:
+ *     stage               The stage that was measured.
+ *     begin               The sample from perfctr_begin().
+ *     bytes               The number of bytes the stage processed.
+ */
+void perfctr_end(perfctr_stage stage, const perfctr_sample *begin, uint64_t bytes);
+
+/*
+ * perfctr_report
+ *
+ * Description:
+ *     Print the totals for each stage with per-call and per-byte figures, IPC and miss rates.
+ */
+void perfctr_report(FILE *out);
+
+void perfctr_reset(void);
+
+#ifdef CDHASH_PERFCTR
+#define PERFCTR_BEGIN(name)                 perfctr_sample name; perfctr_begin(&name)
+#define PERFCTR_END(stage, name, bytes)     perfctr_end(stage, &name, bytes)
+#else
+#define PERFCTR_BEGIN(name)
+#define PERFCTR_END(stage, name, bytes)
+#endif
+
+#endif /* perfctr_h */
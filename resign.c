@@ -0,0 +1,319 @@
+
+/*
+ * Signature replacement
+ * ---------------------
+ *
+ *  The code signature is the last thing in __LINKEDIT, and __LINKEDIT is the last segment in
+ *  the file. The new signature is written where the old one doesn't reach: into the padding
+ *  after the old superblob, and the zero bytes between the end of __LINKEDIT and the end of
+ *  the file. Once it is synced, LC_CODE_SIGNATURE and __LINKEDIT are pointed at it with a
+ *  single write to the header page. A crash before that leaves the old signature in use, and
+ *  one after it the new one.
+ *
+ *  If there isn't room for that, a caller that doesn't need crash safety can have a signature
+ *  no larger than the old one written over it. Otherwise the file has to grow, and goes
+ *  through a copy that is renamed over the original.
+ *
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cs_blobs.h"
+#include "macho_defs.h"
+#include "resign.h"
+
+// Signatures are padded to this alignment, as codesign does.
+#define CS_SIGNATURE_ALIGN 16
+
+// Segment alignment of the target, for __LINKEDIT's vmsize. Not the host's page size: an arm64
+// binary uses 16K pages wherever it is signed.
+#define SEGMENT_ALIGN_ARM64 0x4000
+#define SEGMENT_ALIGN_DEFAULT 0x1000
+
+// The load commands that describe where the signature lives.
+typedef struct macho_signature_layout {
+    struct linkedit_data_command *cs_cmd;
+    struct segment_command_64 *linkedit;
+    size_t header_size;
+    uint64_t segment_align;
+} macho_signature_layout;
+
+// Find the code signature and __LINKEDIT load commands and check that the signature is the
+// last thing in __LINKEDIT.
+static bool
+macho_find_signature_layout(uint8_t *file, size_t size, macho_signature_layout *layout) {
+    struct mach_header_64 *mh = (struct mach_header_64 *)file;
+    if (size < sizeof(*mh) || mh->magic != MH_MAGIC_64
+            || mh->sizeofcmds > size - sizeof(*mh)) {
+        return false;
+    }
+    memset(layout, 0, sizeof(*layout));
+    layout->header_size = sizeof(*mh) + mh->sizeofcmds;
+    layout->segment_align = (mh->cputype == CPU_TYPE_ARM64
+            ? SEGMENT_ALIGN_ARM64 : SEGMENT_ALIGN_DEFAULT);
+    uint8_t *lc_p = (uint8_t *)(mh + 1);
+    uint8_t *lc_end = lc_p + mh->sizeofcmds;
+    while (lc_p < lc_end) {
+        struct load_command *lc = (struct load_command *)lc_p;
+        if ((size_t)(lc_end - lc_p) < sizeof(*lc) || lc->cmdsize < sizeof(*lc)
+                || lc->cmdsize > (size_t)(lc_end - lc_p)) {
+            return false;
+        }
+        if (lc->cmd == LC_CODE_SIGNATURE && lc->cmdsize >= sizeof(*layout->cs_cmd)) {
+            layout->cs_cmd = (struct linkedit_data_command *)lc;
+        } else if (lc->cmd == LC_SEGMENT_64 && lc->cmdsize >= sizeof(*layout->linkedit)
+                && strncmp(((struct segment_command_64 *)lc)->segname, "__LINKEDIT", 16) == 0) {
+            layout->linkedit = (struct segment_command_64 *)lc;
+        }
+        lc_p += lc->cmdsize;
+    }
+    if (layout->cs_cmd == NULL || layout->linkedit == NULL) {
+        return false;
+    }
+    uint64_t cs_end = (uint64_t)layout->cs_cmd->dataoff + layout->cs_cmd->datasize;
+    return layout->cs_cmd->dataoff >= layout->header_size
+        && cs_end <= size
+        && layout->linkedit->fileoff <= layout->cs_cmd->dataoff
+        && layout->linkedit->fileoff + layout->linkedit->filesize == cs_end;
+}
+
+// Point the load commands at a signature of the given size at the given offset.
+static void
+macho_set_signature(const macho_signature_layout *layout, uint32_t dataoff, uint32_t datasize) {
+    uint64_t align = layout->segment_align;
+    layout->cs_cmd->dataoff = dataoff;
+    layout->cs_cmd->datasize = datasize;
+    layout->linkedit->filesize = dataoff + datasize - layout->linkedit->fileoff;
+    uint64_t vmsize = (layout->linkedit->filesize + align - 1) & ~(align - 1);
+    if (layout->linkedit->vmsize < vmsize) {
+        layout->linkedit->vmsize = vmsize;
+    }
+}
+
+// Synchronously write back the pages of a mapping that cover a range.
+static bool
+msync_range(uint8_t *map, uint64_t offset, uint64_t length) {
+    uint64_t page_size = getpagesize();
+    uint64_t start = offset & ~(page_size - 1);
+    return msync(map + start, offset + length - start, MS_SYNC) == 0;
+}
+
+// The offset of the first byte after the old superblob, aligned as a new one would be. If the
+// old signature isn't a superblob that fits in its datasize, all of it counts as used.
+static uint64_t
+old_signature_end(const uint8_t *map, const macho_signature_layout *layout) {
+    uint64_t dataoff = layout->cs_cmd->dataoff;
+    uint32_t datasize = layout->cs_cmd->datasize;
+    const CS_SuperBlob *sb = (const CS_SuperBlob *)(map + dataoff);
+    uint32_t used = datasize;
+    if (datasize >= sizeof(*sb) && ntohl(sb->magic) == CSMAGIC_EMBEDDED_SIGNATURE
+            && ntohl(sb->length) <= datasize) {
+        used = ntohl(sb->length);
+    }
+    return (dataoff + used + CS_SIGNATURE_ALIGN - 1) & ~(uint64_t)(CS_SIGNATURE_ALIGN - 1);
+}
+
+// The end of the space a new signature may be written to without touching anything in use:
+// the end of the old signature, plus the zero bytes that follow it up to the end of the file.
+static uint64_t
+signature_slack_end(const uint8_t *map, size_t size, const macho_signature_layout *layout) {
+    uint64_t end = (uint64_t)layout->cs_cmd->dataoff + layout->cs_cmd->datasize;
+    while (end < size && map[end] == 0) {
+        end++;
+    }
+    return end;
+}
+
+// Whether the two load commands a new signature changes are on the same page, so that
+// pointing them at it is a single page write.
+static bool
+signature_commands_share_page(const uint8_t *map, const macho_signature_layout *layout) {
+    uint64_t page_size = getpagesize();
+    uint64_t cs_cmd = (const uint8_t *)layout->cs_cmd - map;
+    uint64_t linkedit = (const uint8_t *)layout->linkedit - map;
+    uint64_t first = (cs_cmd < linkedit ? cs_cmd : linkedit);
+    uint64_t last = (cs_cmd < linkedit ? linkedit + sizeof(*layout->linkedit)
+            : cs_cmd + sizeof(*layout->cs_cmd)) - 1;
+    return first / page_size == last / page_size;
+}
+
+// Write the new superblob into the slack after the old one, sync it, then point the load
+// commands at it and sync the header. The signature area grows to the end of the new
+// superblob or stays as long as it was, whichever is further, so __LINKEDIT never shrinks.
+// The old superblob is cleared once nothing refers to it.
+static bool
+replace_signature_in_slack(uint8_t *map, const macho_signature_layout *layout,
+        uint64_t dataoff, const void *superblob, size_t length, uint32_t datasize) {
+    uint64_t old_dataoff = layout->cs_cmd->dataoff;
+    uint64_t old_end = old_dataoff + layout->cs_cmd->datasize;
+    if (dataoff + datasize < old_end) {
+        datasize = (uint32_t)(old_end - dataoff);
+    }
+    memcpy(map + dataoff, superblob, length);
+    memset(map + dataoff + length, 0, datasize - length);
+    if (!msync_range(map, dataoff, datasize)) {
+        return false;
+    }
+    macho_set_signature(layout, (uint32_t)dataoff, datasize);
+    if (!msync_range(map, 0, layout->header_size)) {
+        return false;
+    }
+    memset(map + old_dataoff, 0, dataoff - old_dataoff);
+    return msync_range(map, old_dataoff, dataoff - old_dataoff);
+}
+
+// Write the new superblob over the old one. It must fit in the current datasize; the rest of
+// the old signature is cleared and the load commands are left as they are. A crash during the
+// write leaves a torn signature.
+static bool
+replace_signature_over(uint8_t *map, const macho_signature_layout *layout,
+        const void *superblob, size_t length) {
+    uint64_t dataoff = layout->cs_cmd->dataoff;
+    uint32_t datasize = layout->cs_cmd->datasize;
+    memcpy(map + dataoff, superblob, length);
+    memset(map + dataoff + length, 0, datasize - length);
+    return msync_range(map, dataoff, datasize);
+}
+
+// Sync the directory holding path, so that a rename into it is durable.
+static bool
+fsync_parent(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if ((size_t)(slash - path) < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return false;
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+}
+
+// Write a buffer to a file descriptor in full.
+static bool
+write_all(int fd, const void *data, size_t length) {
+    const uint8_t *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Replace the signature by streaming a new copy of the file and renaming it over the original.
+// Whatever followed the old signature in the file follows the new one.
+static bool
+replace_signature_by_copy(const char *path, const uint8_t *map, size_t size, mode_t mode,
+        const macho_signature_layout *layout, const void *superblob, size_t length,
+        uint32_t datasize) {
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path) >= (int)sizeof(temp_path)) {
+        return false;
+    }
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = false;
+    // Patch the load commands in a private copy of the header.
+    uint8_t *header = malloc(layout->header_size);
+    if (header == NULL) {
+        goto out;
+    }
+    memcpy(header, map, layout->header_size);
+    macho_signature_layout copy_layout = {
+        .cs_cmd = (struct linkedit_data_command *)(header + ((uint8_t *)layout->cs_cmd - map)),
+        .linkedit = (struct segment_command_64 *)(header + ((uint8_t *)layout->linkedit - map)),
+        .header_size = layout->header_size,
+        .segment_align = layout->segment_align,
+    };
+    uint32_t dataoff = layout->cs_cmd->dataoff;
+    uint64_t cs_end = (uint64_t)dataoff + layout->cs_cmd->datasize;
+    macho_set_signature(&copy_layout, dataoff, datasize);
+    static const uint8_t padding[CS_SIGNATURE_ALIGN];
+    ok = write_all(fd, header, layout->header_size)
+        && write_all(fd, map + layout->header_size, dataoff - layout->header_size)
+        && write_all(fd, superblob, length)
+        && write_all(fd, padding, datasize - length)
+        && write_all(fd, map + cs_end, size - cs_end)
+        && fchmod(fd, mode) == 0
+        && fsync(fd) == 0;
+    free(header);
+out:
+    close(fd);
+    if (ok) {
+        ok = (rename(temp_path, path) == 0);
+    }
+    if (!ok) {
+        unlink(temp_path);
+        return false;
+    }
+    return fsync_parent(path);
+}
+
+bool
+cs_replace_signature(const char *path, const void *superblob, size_t length, bool crash_safe,
+        bool *in_place) {
+    if (length == 0 || length > UINT32_MAX - CS_SIGNATURE_ALIGN) {
+        return false;
+    }
+    uint32_t datasize = (uint32_t)((length + CS_SIGNATURE_ALIGN - 1) & ~(CS_SIGNATURE_ALIGN - 1));
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    bool ok = false;
+    macho_signature_layout layout;
+    if (macho_find_signature_layout(map, size, &layout)) {
+        uint64_t dataoff = old_signature_end(map, &layout);
+        bool use_slack = (dataoff + datasize <= signature_slack_end(map, size, &layout)
+                && dataoff + datasize <= UINT32_MAX
+                && (!crash_safe || signature_commands_share_page(map, &layout)));
+        bool use_old = (!use_slack && !crash_safe && length <= layout.cs_cmd->datasize);
+        if (use_slack) {
+            ok = replace_signature_in_slack(map, &layout, dataoff, superblob, length, datasize);
+        } else if (use_old) {
+            ok = replace_signature_over(map, &layout, superblob, length);
+        } else {
+            ok = replace_signature_by_copy(path, map, size, st.st_mode & 07777, &layout,
+                    superblob, length, datasize);
+        }
+        if (in_place != NULL) {
+            *in_place = (use_slack || use_old);
+        }
+    }
+    munmap(map, size);
+    return ok;
+}
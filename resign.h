@@ -0,0 +1,36 @@
+
+#ifndef resign_h
+#define resign_h
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * cs_replace_signature
+ *
+ * Description:
+ *     Replace the embedded signature of a Mach-O file with a new superblob.
+ *
+ *     If there is room for the new superblob after the old one, in the padding of the old
+ *     signature and the zero bytes that follow it up to the end of the file, it is written
+ *     and synced there, then LC_CODE_SIGNATURE and __LINKEDIT are pointed at it and the
+ *     header is synced. The file always has either the old or the new signature.
+ *
+ *     Otherwise, if crash safety was not asked for and the new superblob fits in the current
+ *     datasize, it is written over the old one through a shared mapping and synced; a crash
+ *     during the write leaves the file with a torn signature. Failing both, the file has to
+ *     grow: it is rewritten by streaming a copy to a temporary file next to it, syncing it,
+ *     renaming it over the original and syncing the directory. Anything that followed the old
+ *     signature in the file is kept after the new one.
+ *
+ * Parameters:
+ *     path                The path to the Mach-O file.
+ *     superblob           The new CS_SuperBlob.
+ *     length              The size of the new superblob.
+ *     crash_safe          Never write over the old signature.
+ *     in_place          out    If not NULL, on return, whether the file was updated in place.
+ */
+bool cs_replace_signature(const char *path, const void *superblob, size_t length,
+        bool crash_safe, bool *in_place);
+
+#endif /* resign_h */